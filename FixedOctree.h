@@ -0,0 +1,388 @@
+#ifndef FUSION_FIXEDOCTREE_H
+#define FUSION_FIXEDOCTREE_H
+
+#include <Fusion/Base/Octree.h>
+#include <Fusion/Base/Timer.h>
+#include <Fusion/Base/Log.h>
+
+#include <algorithm>
+#include <type_traits>
+
+namespace Fusion
+{
+	/// Number of layers Octree::createLayerGrid produces for a single dimension
+	constexpr int fixedOctreeLayers(int dim, int minCubeSize) {
+		int layers = 1;
+		for (int half = dim / 2; half >= minCubeSize; half /= 2)
+			layers++;
+		return layers;
+	}
+
+
+	/// Compile-time cell sizes and positions of one Octree axis, mirrors Octree::createLayerGrid
+	template<int Dim, int MinCubeSize, int NumLayers>
+	struct FixedOctreeAxis {
+		static constexpr int Layers = fixedOctreeLayers(Dim, MinCubeSize);	///< Layers of this axis before it stops splitting
+		static constexpr int Cells = 1 << (Layers - 1);						///< Number of cells on the last layer
+
+		/// Number of cells in the given layer
+		static constexpr int count(int layer) { return 1 << (layer < Layers ? layer : Layers - 1); }
+
+		/// Split between the given and the next layer
+		static constexpr int split(int layer) { return count(layer + 1) / count(layer); }
+
+		constexpr FixedOctreeAxis() : size{}, offset{}, uniform{} {
+			for (int layer = 0; layer < NumLayers; layer++) {
+				int n = count(layer);
+				for (int i = 0; i < n; i++) {
+					if (layer == 0)
+						size[layer][i] = Dim;
+					else if (n == count(layer - 1))
+						size[layer][i] = size[layer - 1][i];
+					else {
+						int parent = size[layer - 1][i / 2];
+						size[layer][i] = (i % 2 == 0) ? parent / 2 : parent - parent / 2;
+					}
+				}
+				int pos = 0;
+				uniform[layer] = size[layer][0];
+				for (int i = 0; i < n; i++) {
+					offset[layer][i] = pos;
+					pos += size[layer][i];
+					if (size[layer][i] != size[layer][0])
+						uniform[layer] = 0;
+				}
+			}
+		}
+
+		int size[NumLayers][Cells];		///< Cell size for every layer
+		int offset[NumLayers][Cells];	///< Cell voxel position for every layer
+		int uniform[NumLayers];			///< Common cell size of every layer, 0 if the cells differ
+	};
+
+
+	/// Octree with image dimensions and cell size fixed at compile time
+	/** Layer sizes, splits and cell positions are constexpr tables, so fill, classification and enumeration
+		can be unrolled and vectorized for the given shape. The runtime layer grids of the Octree are set up
+		as well, so all other Octree methods work on it. The methods below hide the Octree methods of the same
+		name rather than override them: calls through an Octree pointer or reference run the generic versions,
+		which give the same result without the compile-time tables. */
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	class FixedOctree : public Octree {
+	public:
+		static constexpr int NumLayers = std::max(std::max(fixedOctreeLayers(Width, MinCubeSize),
+			fixedOctreeLayers(Height, MinCubeSize)), fixedOctreeLayers(Slices, MinCubeSize));
+
+		typedef FixedOctreeAxis<Width, MinCubeSize, NumLayers> AxisX;
+		typedef FixedOctreeAxis<Height, MinCubeSize, NumLayers> AxisY;
+		typedef FixedOctreeAxis<Slices, MinCubeSize, NumLayers> AxisZ;
+
+		/// Creates the Octree for the fixed geometry, it still needs to be filled
+		FixedOctree() : Octree(MinCubeSize) {
+			createLayers(Width, Height, Slices);
+		}
+
+		/// Set the intensity range defining 'inside' and update
+		/** Returns true if something has changed. */
+		bool setInsideRange(int min, int max);
+
+		/// Convenience method, set range with normalized scale (0..1), or in rescaled units if a mapping is set
+		bool setInsideRange(double min, double max) {
+			int storedMin, storedMax;
+			getStoredRange(min, max, storedMin, storedMax);
+			return setInsideRange(storedMin, storedMax);
+		}
+
+		/// Classify with a custom inside rule, see Octree::classify()
+		template<typename Predicate> void classify(const Predicate& predicate);
+
+		/// Enumerate all inside cube cells with their position and size
+		const std::vector<int>& enumerate();
+
+		/// Fast template method to (re-)fill Octree from image data of the fixed size
+		template<typename T> void fill(TypedImage<T>* image);
+
+		/// Fill Octree from image data, which must have the fixed size
+		void setImage(MemImage* image);
+
+	private:
+		typedef std::integral_constant<bool, true> LastLayer;
+		typedef std::integral_constant<bool, false> InnerLayer;
+
+		/// Min/max of a row of voxels, the length is a compile-time constant unless N is 0
+		template<int N, typename T> static void rowMinMax(const T* row, int length, int& min, int& max) {
+			const int n = N ? N : length;
+			for (int i = 0; i < n; i++) {
+				min = std::min(min, (int)row[i]);
+				max = std::max(max, (int)row[i]);
+			}
+		}
+
+		/// Fill the elements of a layer from the layer below, then continue with the parent layer
+		template<int Layer> void propagate(std::integral_constant<int, Layer>);
+		void propagate(std::integral_constant<int, -1>) {}
+
+		/// Recursively check and update Octree children for the predicate
+		template<int Layer, typename Predicate> ElementType checkChildren(const Predicate& predicate, int px, int py, int pz, InnerLayer);
+		template<int Layer, typename Predicate> ElementType checkChildren(const Predicate& predicate, int px, int py, int pz, LastLayer);
+
+		/// Recursively enumerate Octree children which are inside
+		template<int Layer> void enumerateChildren(int px, int py, int pz, int*& cubes, InnerLayer);
+		template<int Layer> void enumerateChildren(int px, int py, int pz, int*& cubes, LastLayer);
+
+		/// Tag telling whether the given layer is the last one
+		template<int Layer> static std::integral_constant<bool, Layer == NumLayers - 1> layerTag() { return std::integral_constant<bool, Layer == NumLayers - 1>(); }
+
+		static constexpr AxisX s_x = AxisX();	///< Cell geometry in x
+		static constexpr AxisY s_y = AxisY();	///< Cell geometry in y
+		static constexpr AxisZ s_z = AxisZ();	///< Cell geometry in z
+	};
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	constexpr typename FixedOctree<Width, Height, Slices, MinCubeSize>::AxisX FixedOctree<Width, Height, Slices, MinCubeSize>::s_x;
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	constexpr typename FixedOctree<Width, Height, Slices, MinCubeSize>::AxisY FixedOctree<Width, Height, Slices, MinCubeSize>::s_y;
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	constexpr typename FixedOctree<Width, Height, Slices, MinCubeSize>::AxisZ FixedOctree<Width, Height, Slices, MinCubeSize>::s_z;
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	void FixedOctree<Width, Height, Slices, MinCubeSize>::setImage(MemImage* image) {
+		if (image->width() != Width || image->height() != Height || image->slices() != Slices) {
+			LOG_DEBUG("Octree image size " << image->width() << " x " << image->height() << " x " << image->slices()
+				<< " does not match " << Width << " x " << Height << " x " << Slices);
+			return;
+		}
+		OctreeMemoryManager::Use use(this);
+		Timer timer;
+		// The layers are reused, reset them to the state createLayers() leaves
+		clearLayerState();
+		for (int layer = 0; layer < NumLayers; layer++) {
+			const int size = AxisX::count(layer) * AxisY::count(layer) * AxisZ::count(layer);
+			std::fill(m_data[layer], m_data[layer] + size, OctreeElement());
+			std::fill(m_counts[layer].begin(), m_counts[layer].end(), InsideCount());
+		}
+		m_image = image;
+		if (image->type() == Image::USHORT)
+			fill<unsigned short>(reinterpret_cast<TypedImage<unsigned short>*>(image));
+		else if (image->type() == Image::UBYTE)
+			fill<unsigned char>(reinterpret_cast<TypedImage<unsigned char>*>(image));
+		if (m_hashing)
+			computeHashes();
+		LOG_DEBUG("Octree computation completed in " << timer.passed() << " ms");
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	template<typename T> void FixedOctree<Width, Height, Slices, MinCubeSize>::fill(TypedImage<T>* image) {
+		m_usable = false;
+		m_scale = (double)((1 << (8 * sizeof(T))) - 1);
+
+		const int leaf = NumLayers - 1;
+		const int nx = AxisX::count(leaf);
+		const int ny = AxisY::count(leaf);
+		const int nz = AxisZ::count(leaf);
+		const T* imgPtr = image->pointer();
+		OctreeElement* element = m_data[leaf];
+
+		// Fill the highest layer from image data
+		for (int z = 0; z < nz; z++) {
+			for (int y = 0; y < ny; y++) {
+				for (int x = 0; x < nx; x++, element++) {
+					int min = std::numeric_limits<int>::max();
+					int max = std::numeric_limits<int>::min();
+					for (int zz = 0; zz < s_z.size[leaf][z]; zz++) {
+						for (int yy = 0; yy < s_y.size[leaf][y]; yy++) {
+							const T* row = imgPtr + s_x.offset[leaf][x] + Width * (s_y.offset[leaf][y] + yy + Height * (s_z.offset[leaf][z] + zz));
+							rowMinMax<s_x.uniform[leaf]>(row, s_x.size[leaf][x], min, max);
+						}
+					}
+					element->min = min;
+					element->max = max;
+				}
+			}
+		}
+
+		// Propagate up to the other layers
+		propagate(std::integral_constant<int, NumLayers - 2>());
+
+		m_usable = true;
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	template<int Layer> void FixedOctree<Width, Height, Slices, MinCubeSize>::propagate(std::integral_constant<int, Layer>) {
+		const int nx = AxisX::count(Layer), ny = AxisY::count(Layer), nz = AxisZ::count(Layer);
+		const int nxx = AxisX::split(Layer), nyy = AxisY::split(Layer), nzz = AxisZ::split(Layer);
+		OctreeElement* elementUp = m_data[Layer];
+		const OctreeElement* down = m_data[Layer + 1];
+		for (int z = 0; z < nz; z++) {
+			for (int y = 0; y < ny; y++) {
+				for (int x = 0; x < nx; x++, elementUp++) {
+					int min = std::numeric_limits<int>::max();
+					int max = std::numeric_limits<int>::min();
+					for (int zz = 0; zz < nzz; zz++) {
+						for (int yy = 0; yy < nyy; yy++) {
+							for (int xx = 0; xx < nxx; xx++) {
+								const OctreeElement& elementDown = down[nxx * x + xx + nx * nxx * (nyy * y + yy + ny * nyy * (nzz * z + zz))];
+								min = std::min(min, elementDown.min);
+								max = std::max(max, elementDown.max);
+							}
+						}
+					}
+					elementUp->min = min;
+					elementUp->max = max;
+				}
+			}
+		}
+		propagate(std::integral_constant<int, Layer - 1>());
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	bool FixedOctree<Width, Height, Slices, MinCubeSize>::setInsideRange(int min, int max) {
+		OctreeMemoryManager::Use use(this);
+		if ((m_min == min) && (m_max == max))
+			return false;
+		m_min = min; m_max = max;
+		m_classified = true;
+		m_voxelsInside = 0;
+		Timer timer;
+		RangePredicate predicate = { m_min, m_max };
+		checkChildren<0>(predicate, 0, 0, 0, layerTag<0>());
+		LOG_DEBUG("Octree range [" << m_min << ".." << m_max << "], " << m_voxelsInside << " voxels inside, " << timer.passed() << " ms");
+		return true;
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	template<typename Predicate> void FixedOctree<Width, Height, Slices, MinCubeSize>::classify(const Predicate& predicate) {
+		OctreeMemoryManager::Use use(this);
+		// The classification no longer corresponds to any range, force the next setInsideRange to update
+		m_min = std::numeric_limits<int>::max();
+		m_max = std::numeric_limits<int>::min();
+		m_classified = true;
+		m_voxelsInside = 0;
+		checkChildren<0>(predicate, 0, 0, 0, layerTag<0>());
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	template<int Layer, typename Predicate>
+	Octree::ElementType FixedOctree<Width, Height, Slices, MinCubeSize>::checkChildren(const Predicate& predicate, int px, int py, int pz, LastLayer) {
+		const int nx = AxisX::count(Layer), ny = AxisY::count(Layer);
+		int index = px + nx * (py + ny * pz);
+		OctreeElement& element = m_data[Layer][index];
+		InsideCount& count = m_counts[Layer][index];
+		if (predicate(element.min, element.max) == LEAF_OUT) {
+			element.type = LEAF_OUT;
+			count.cubes = 0;
+			count.voxels = 0;
+		}
+		else {
+			element.type = LEAF_IN;
+			count.cubes = 1;
+			count.voxels = s_x.size[Layer][px] * s_y.size[Layer][py] * s_z.size[Layer][pz];
+			m_voxelsInside += (int)count.voxels;
+		}
+		return element.type;
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	template<int Layer, typename Predicate>
+	Octree::ElementType FixedOctree<Width, Height, Slices, MinCubeSize>::checkChildren(const Predicate& predicate, int px, int py, int pz, InnerLayer) {
+		const int nx = AxisX::count(Layer), ny = AxisY::count(Layer);
+		const int nxx = AxisX::split(Layer), nyy = AxisY::split(Layer), nzz = AxisZ::split(Layer);
+		int index = px + nx * (py + ny * pz);
+		OctreeElement& element = m_data[Layer][index];
+		InsideCount& count = m_counts[Layer][index];
+		ElementType type = predicate(element.min, element.max);
+		if (type == LEAF_OUT) {
+			element.type = LEAF_OUT;
+			count.cubes = 0;
+			count.voxels = 0;
+		}
+		else if (type == LEAF_IN) {
+			element.type = LEAF_IN;
+			count.cubes = 1;
+			count.voxels = (int64_t)s_x.size[Layer][px] * s_y.size[Layer][py] * s_z.size[Layer][pz];
+			m_voxelsInside += (int)count.voxels;
+		}
+		else {
+			// Something else, need to check children
+			bool allIn = true, allOut = true;
+			int cubes = 0;
+			int64_t voxels = 0;
+			for (int zz = 0; zz < nzz; zz++) {
+				for (int yy = 0; yy < nyy; yy++) {
+					for (int xx = 0; xx < nxx; xx++) {
+						int cx = nxx * px + xx, cy = nyy * py + yy, cz = nzz * pz + zz;
+						ElementType value = checkChildren<Layer + 1>(predicate, cx, cy, cz, layerTag<Layer + 1>());
+						if (value == LEAF_IN)		allOut = false;
+						else if (value == LEAF_OUT) allIn = false;
+						else { allIn = false; allOut = false; }
+						const InsideCount& child = m_counts[Layer + 1][cx + nx * nxx * (cy + ny * nyy * cz)];
+						cubes += child.cubes;
+						voxels += child.voxels;
+					}
+				}
+			}
+			if (allIn)		 element.type = LEAF_IN;
+			else if (allOut) element.type = LEAF_OUT;
+			else			 element.type = NODE;
+			count.cubes = allIn ? 1 : cubes;
+			count.voxels = voxels;
+		}
+		return element.type;
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	const std::vector<int>& FixedOctree<Width, Height, Slices, MinCubeSize>::enumerate() {
+		OctreeMemoryManager::Use use(this);
+		int num = getNumCubesInside();
+		m_cubesInside.resize(6 * num);
+		if (num > 0) {
+			int* cubes = &m_cubesInside[0];
+			enumerateChildren<0>(0, 0, 0, cubes, layerTag<0>());
+		}
+		LOG_DEBUG("Octree has " << num << " cubes");
+		return m_cubesInside;
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	template<int Layer> void FixedOctree<Width, Height, Slices, MinCubeSize>::enumerateChildren(int px, int py, int pz, int*& cubes, LastLayer) {
+		const int nx = AxisX::count(Layer), ny = AxisY::count(Layer);
+		if (m_data[Layer][px + nx * (py + ny * pz)].type == LEAF_IN) {
+			*cubes++ = s_x.offset[Layer][px];
+			*cubes++ = s_y.offset[Layer][py];
+			*cubes++ = s_z.offset[Layer][pz];
+			*cubes++ = s_x.size[Layer][px];
+			*cubes++ = s_y.size[Layer][py];
+			*cubes++ = s_z.size[Layer][pz];
+		}
+	}
+
+
+	template<int Width, int Height, int Slices, int MinCubeSize>
+	template<int Layer> void FixedOctree<Width, Height, Slices, MinCubeSize>::enumerateChildren(int px, int py, int pz, int*& cubes, InnerLayer) {
+		const int nx = AxisX::count(Layer), ny = AxisY::count(Layer);
+		const int nxx = AxisX::split(Layer), nyy = AxisY::split(Layer), nzz = AxisZ::split(Layer);
+		ElementType type = m_data[Layer][px + nx * (py + ny * pz)].type;
+		if (type == LEAF_IN)
+			// Add this cube, same as on the last layer
+			enumerateChildren<Layer>(px, py, pz, cubes, LastLayer());
+		else if (type == NODE) {
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						enumerateChildren<Layer + 1>(nxx * px + xx, nyy * py + yy, nzz * pz + zz, cubes, layerTag<Layer + 1>());
+		}
+	}
+
+}
+
+#endif
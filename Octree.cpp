@@ -1,48 +1,553 @@
 #include <Fusion/Base/Octree.h>
+#include <Fusion/Base/OctreeMemoryManager.h>
 #include <Fusion/Base/Timer.h>
 #include <Fusion/Base/Log.h>
 
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <cstring>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 
 namespace Fusion
 {
 	namespace {
 		class ThreadAbortedException : public std::exception {
 		};
+
+		/// Runs func(i) for all i in [begin, end) on all hardware threads
+		template<typename F> void parallelFor(int begin, int end, F func) {
+			int numThreads = std::min((int)std::thread::hardware_concurrency(), end - begin);
+			std::atomic<int> next(begin);
+			auto worker = [&]() {
+				for (int i = next++; i < end; i = next++)
+					func(i);
+			};
+			std::vector<std::thread> threads;
+			for (int i = 1; i < numThreads; i++)
+				threads.push_back(std::thread(worker));
+			worker();
+			for (auto& thread : threads)
+				thread.join();
+		}
+
+		/// Packs a row of mask voxels into 64 bit words, one bit per non-zero voxel
+		void packMaskRow(const unsigned char* row, int width, uint64_t* words) {
+			for (int w = 0; 64 * w < width; w++) {
+				const unsigned char* voxels = row + 64 * w;
+				int n = std::min(64, width - 64 * w);
+				uint64_t word = 0;
+				int i = 0;
+				for (; i + 8 <= n; i += 8) {
+					uint64_t bytes;
+					memcpy(&bytes, voxels + i, 8);
+					// High bit of every non-zero byte, then gather the eight high bits into one byte
+					bytes = (((bytes & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | bytes) & 0x8080808080808080ULL;
+					word |= (((bytes >> 7) * 0x0102040810204080ULL) >> 56) << i;
+				}
+				for (; i < n; i++)
+					word |= (uint64_t)(voxels[i] != 0) << i;
+				words[w] = word;
+			}
+		}
+
+		const uint64_t Prime1 = 11400714785074694791ULL;
+		const uint64_t Prime2 = 14029467366897019727ULL;
+		const uint64_t Prime3 = 1609587929392839161ULL;
+		const uint64_t Prime4 = 9650029242287828579ULL;
+		const uint64_t Prime5 = 2870177450012600261ULL;
+
+		inline uint64_t rotateLeft(uint64_t value, int bits) {
+			return (value << bits) | (value >> (64 - bits));
+		}
+
+		inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+			return rotateLeft(acc + input * Prime2, 31) * Prime1;
+		}
+
+		inline uint64_t hashMerge(uint64_t hash, uint64_t acc) {
+			return (hash ^ hashRound(0, acc)) * Prime1 + Prime4;
+		}
+
+		/// XXH64 of a byte range, the four independent lanes of every 32 byte stripe vectorize well
+		uint64_t hashBytes(const unsigned char* data, size_t length, uint64_t seed) {
+			const unsigned char* end = data + length;
+			uint64_t hash;
+			if (length >= 32) {
+				uint64_t acc[4] = { seed + Prime1 + Prime2, seed + Prime2, seed, seed - Prime1 };
+				for (; data + 32 <= end; data += 32) {
+					uint64_t lanes[4];
+					memcpy(lanes, data, 32);
+					for (int i = 0; i < 4; i++)
+						acc[i] = hashRound(acc[i], lanes[i]);
+				}
+				hash = rotateLeft(acc[0], 1) + rotateLeft(acc[1], 7) + rotateLeft(acc[2], 12) + rotateLeft(acc[3], 18);
+				for (int i = 0; i < 4; i++)
+					hash = hashMerge(hash, acc[i]);
+			}
+			else
+				hash = seed + Prime5;
+			hash += length;
+			for (; data + 8 <= end; data += 8) {
+				uint64_t lane;
+				memcpy(&lane, data, 8);
+				hash = rotateLeft(hash ^ hashRound(0, lane), 27) * Prime1 + Prime4;
+			}
+			if (data + 4 <= end) {
+				uint32_t lane;
+				memcpy(&lane, data, 4);
+				hash = rotateLeft(hash ^ (lane * Prime1), 23) * Prime2 + Prime3;
+				data += 4;
+			}
+			for (; data < end; data++)
+				hash = rotateLeft(hash ^ (*data * Prime5), 11) * Prime1;
+			hash ^= hash >> 33; hash *= Prime2;
+			hash ^= hash >> 29; hash *= Prime3;
+			hash ^= hash >> 32;
+			return hash;
+		}
+
+		/// Trilinear interpolation in voxel coordinates, positions outside the image give the outside value
+		template<typename T> T sampleTrilinear(const T* data, int width, int height, int slices, double x, double y, double z, T outsideValue) {
+			if (x < 0 || y < 0 || z < 0 || x > width - 1 || y > height - 1 || z > slices - 1)
+				return outsideValue;
+			int x0 = (int)x, y0 = (int)y, z0 = (int)z;
+			int x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1), z1 = std::min(z0 + 1, slices - 1);
+			double fx = x - x0, fy = y - y0, fz = z - z0;
+			auto at = [&](int xx, int yy, int zz) { return (double)data[xx + (size_t)width * (yy + (size_t)height * zz)]; };
+			double c00 = at(x0, y0, z0) * (1 - fx) + at(x1, y0, z0) * fx;
+			double c10 = at(x0, y1, z0) * (1 - fx) + at(x1, y1, z0) * fx;
+			double c01 = at(x0, y0, z1) * (1 - fx) + at(x1, y0, z1) * fx;
+			double c11 = at(x0, y1, z1) * (1 - fx) + at(x1, y1, z1) * fx;
+			double c0 = c00 * (1 - fy) + c10 * fy;
+			double c1 = c01 * (1 - fy) + c11 * fy;
+			return (T)(c0 * (1 - fz) + c1 * fz + 0.5);
+		}
+
+		/// Separable convolution of the block [x0, x1) x [y0, y1) x [z0, z1) with clamped borders, x running fastest
+		template<typename T> void convolveBlock(const TypedImage<T>* source, const std::vector<float>& kernelX, const std::vector<float>& kernelY,
+			const std::vector<float>& kernelZ, int x0, int y0, int z0, int x1, int y1, int z1, float* values) {
+			const T* data = source->pointer();
+			int width = source->width(), height = source->height(), slices = source->slices();
+			int rx = (int)kernelX.size() / 2, ry = (int)kernelY.size() / 2, rz = (int)kernelZ.size() / 2;
+			int sx = x1 - x0, sy = y1 - y0 + 2 * ry, sz = z1 - z0 + 2 * rz;
+			auto clamp = [](int v, int size) { return std::min(std::max(v, 0), size - 1); };
+
+			// Along x, for all rows the following passes need
+			std::vector<float> alongX((size_t)sx * sy * sz);
+			for (int z = 0; z < sz; z++) {
+				for (int y = 0; y < sy; y++) {
+					const T* row = data + (size_t)width * (clamp(y0 - ry + y, height) + (size_t)height * clamp(z0 - rz + z, slices));
+					float* out = &alongX[(size_t)sx * (y + sy * z)];
+					for (int x = 0; x < sx; x++) {
+						float sum = 0;
+						for (int i = 0; i < (int)kernelX.size(); i++)
+							sum += kernelX[i] * row[clamp(x0 + x + i - rx, width)];
+						out[x] = sum;
+					}
+				}
+			}
+			// Along y
+			int ty = y1 - y0;
+			std::vector<float> alongY((size_t)sx * ty * sz);
+			for (int z = 0; z < sz; z++)
+				for (int y = 0; y < ty; y++)
+					for (int x = 0; x < sx; x++) {
+						float sum = 0;
+						for (int i = 0; i < (int)kernelY.size(); i++)
+							sum += kernelY[i] * alongX[x + (size_t)sx * (y + i + sy * z)];
+						alongY[x + (size_t)sx * (y + ty * z)] = sum;
+					}
+			// Along z
+			int tz = z1 - z0;
+			for (int z = 0; z < tz; z++)
+				for (int y = 0; y < ty; y++)
+					for (int x = 0; x < sx; x++) {
+						float sum = 0;
+						for (int i = 0; i < (int)kernelZ.size(); i++)
+							sum += kernelZ[i] * alongY[x + (size_t)sx * (y + ty * (z + i))];
+						values[x + (size_t)sx * (y + ty * z)] = sum;
+					}
+		}
+
+		/// Index of the lowest set bit, bits must not be zero
+		inline int lowestBit(uint64_t bits) {
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanForward64(&index, bits);
+			return (int)index;
+#else
+			return __builtin_ctzll(bits);
+#endif
+		}
+
+		/// Spreads the lower 21 bits of v so that two zero bits follow every bit
+		uint64_t spreadBits(uint64_t v) {
+			v &= 0x1fffff;
+			v = (v | v << 32) & 0x1f00000000ffffULL;
+			v = (v | v << 16) & 0x1f0000ff0000ffULL;
+			v = (v | v << 8) & 0x100f00f00f00f00fULL;
+			v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+			v = (v | v << 2) & 0x1249249249249249ULL;
+			return v;
+		}
+
+		/// Interleaves the bits of the leaf cell coordinates into a Morton code
+		uint64_t mortonCode(int x, int y, int z) {
+			return spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2);
+		}
+
+		/// Squared distance from a point to the box [lo, hi]
+		double pointBoxDistance2(const double p[3], const double lo[3], const double hi[3]) {
+			double sum = 0;
+			for (int i = 0; i < 3; i++) {
+				double d = std::max(std::max(lo[i] - p[i], p[i] - hi[i]), 0.0);
+				sum += d * d;
+			}
+			return sum;
+		}
+
+		/// Exact squared distance from the segment a..b to the box [lo, hi]
+		/** Between the parameters where a coordinate crosses a box face the distance is a single quadratic,
+			whose clamped minimum is evaluated per piece. */
+		double segmentBoxDistance2(const double a[3], const double b[3], const double lo[3], const double hi[3]) {
+			double d[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+			double ts[8] = { 0, 1 };
+			int n = 2;
+			for (int i = 0; i < 3; i++) {
+				if (d[i] == 0)
+					continue;
+				double crossings[2] = { (lo[i] - a[i]) / d[i], (hi[i] - a[i]) / d[i] };
+				for (double t : crossings) {
+					if (t <= 0 || t >= 1)
+						continue;
+					// Insert sorted, there are at most six crossings
+					int k = n++;
+					for (; ts[k - 1] > t; k--)
+						ts[k] = ts[k - 1];
+					ts[k] = t;
+				}
+			}
+			double best = std::numeric_limits<double>::infinity();
+			for (int k = 0; k + 1 < n; k++) {
+				double mid = 0.5 * (ts[k] + ts[k + 1]);
+				double qa = 0, qb = 0;
+				for (int i = 0; i < 3; i++) {
+					double p = a[i] + mid * d[i];
+					if (p >= lo[i] && p <= hi[i])
+						continue;
+					double e = a[i] - (p < lo[i] ? lo[i] : hi[i]);
+					qa += d[i] * d[i];
+					qb += d[i] * e;
+				}
+				double t = qa > 0 ? std::min(std::max(-qb / qa, ts[k]), ts[k + 1]) : ts[k];
+				double p[3] = { a[0] + t * d[0], a[1] + t * d[1], a[2] + t * d[2] };
+				best = std::min(best, pointBoxDistance2(p, lo, hi));
+			}
+			return best;
+		}
+
+		/// Exact squared distance transform of n values at the given stride in place, after Felzenszwalb and Huttenlocher
+		/** Values are the squared distances so far, infinity where unknown. The buffers hold at least n + 1 values. */
+		void squaredDistance1D(float* values, int n, size_t stride, std::vector<float>& f, std::vector<int>& v, std::vector<double>& z) {
+			const float infinity = std::numeric_limits<float>::infinity();
+			for (int q = 0; q < n; q++)
+				f[q] = values[q * stride];
+			// Lower envelope of the parabolas rooted at all known values
+			int k = -1;
+			for (int q = 0; q < n; q++) {
+				if (f[q] == infinity)
+					continue;
+				double s = -std::numeric_limits<double>::infinity();
+				while (k >= 0) {
+					s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * (q - v[k]));
+					if (s > z[k])
+						break;
+					k--;
+				}
+				if (k < 0)
+					s = -std::numeric_limits<double>::infinity();
+				v[++k] = q;
+				z[k] = s;
+			}
+			if (k < 0)
+				return;
+			z[k + 1] = std::numeric_limits<double>::infinity();
+			for (int q = 0, j = 0; q < n; q++) {
+				while (z[j + 1] < q)
+					j++;
+				values[q * stride] = (float)((q - v[j]) * (q - v[j])) + f[v[j]];
+			}
+		}
+
+		/// Squared distances to the nearest voxels inside and outside [min, max] for a voxel box grown by reach
+		/** The grown box is clamped to the image and returned as x0, y0, z0, x1, y1, z1, the distances are
+			stored for all its voxels with x running fastest. Voxels beyond the grown box are not seen. */
+		template<typename T> void boxDistances(const TypedImage<T>* image, int min, int max, const int box[6], int reach, int grown[6],
+			std::vector<float>& toInside, std::vector<float>& toOutside) {
+			int dims[3] = { image->width(), image->height(), image->slices() };
+			for (int a = 0; a < 3; a++) {
+				grown[a] = std::max(0, box[a] - reach);
+				grown[a + 3] = std::min(dims[a], box[a + 3] + reach);
+			}
+			int sx = grown[3] - grown[0], sy = grown[4] - grown[1], sz = grown[5] - grown[2];
+			const float infinity = std::numeric_limits<float>::infinity();
+			const T* imgPtr = image->pointer();
+			toInside.resize((size_t)sx * sy * sz);
+			toOutside.resize((size_t)sx * sy * sz);
+			for (int z = 0; z < sz; z++)
+				for (int y = 0; y < sy; y++)
+					for (int x = 0; x < sx; x++) {
+						int value = (int)imgPtr[grown[0] + x + (size_t)dims[0] * (grown[1] + y + (size_t)dims[1] * (grown[2] + z))];
+						bool inside = value >= min && value <= max;
+						toInside[x + (size_t)sx * (y + (size_t)sy * z)] = inside ? 0.0f : infinity;
+						toOutside[x + (size_t)sx * (y + (size_t)sy * z)] = inside ? infinity : 0.0f;
+					}
+			int longest = std::max(std::max(sx, sy), sz);
+			std::vector<float> f(longest + 1);
+			std::vector<int> v(longest + 1);
+			std::vector<double> zs(longest + 1);
+			for (float* values : { &toInside[0], &toOutside[0] }) {
+				for (int z = 0; z < sz; z++)
+					for (int y = 0; y < sy; y++)
+						squaredDistance1D(values + (size_t)sx * (y + (size_t)sy * z), sx, 1, f, v, zs);
+				for (int z = 0; z < sz; z++)
+					for (int x = 0; x < sx; x++)
+						squaredDistance1D(values + x + (size_t)sx * sy * z, sy, sx, f, v, zs);
+				for (int y = 0; y < sy; y++)
+					for (int x = 0; x < sx; x++)
+						squaredDistance1D(values + x + (size_t)sx * y, sz, (size_t)sx * sy, f, v, zs);
+			}
+		}
+
+		/// Distance from the core of a probe shape to the box [lo, hi]
+		double coreDistance(const Octree::ProbeShape& shape, const double lo[3], const double hi[3]) {
+			if (shape.kind == Octree::ProbeShape::SPHERE)
+				return std::sqrt(pointBoxDistance2(shape.a, lo, hi));
+			if (shape.kind == Octree::ProbeShape::CAPSULE)
+				return std::sqrt(segmentBoxDistance2(shape.a, shape.b, lo, hi));
+			double sum = 0;
+			for (int i = 0; i < 3; i++) {
+				double d = std::max(std::max(lo[i] - shape.b[i], shape.a[i] - hi[i]), 0.0);
+				sum += d * d;
+			}
+			return std::sqrt(sum);
+		}
 	}
 
 	Octree::Octree(int minCubeSize) :
 		m_minCubeSize(minCubeSize),
 		m_min(std::numeric_limits<int>::min()),
 		m_max(std::numeric_limits<int>::max()),
+		m_classified(false),
 		m_scale(1.0),
 		m_voxelsInside(0),
 		m_thread(0),
-		m_usable(false)
+		m_abortThread(false),
+		m_usable(false),
+		m_image(0),
+		m_hashing(false),
+		m_released(false),
+		m_uses(0)
 	{
+		m_mapping.slope = 0;
+		m_mapping.intercept = 0;
+		OctreeMemoryManager::instance().add(this);
 	}
 
-	Octree::Octree(MemImage* image, int minCubeSize) :
+	Octree::Octree(MemImage* image, int minCubeSize, bool hashing) :
 		m_minCubeSize(minCubeSize),
 		m_min(std::numeric_limits<int>::min()),
 		m_max(std::numeric_limits<int>::max()),
+		m_classified(false),
 		m_scale(1.0),
 		m_voxelsInside(0),
 		m_thread(0),
 		m_abortThread(false),
-		m_usable(false)
+		m_usable(false),
+		m_image(0),
+		m_hashing(hashing),
+		m_released(false),
+		m_uses(0)
 	{
+		m_mapping.slope = 0;
+		m_mapping.intercept = 0;
+		OctreeMemoryManager::instance().add(this);
 		m_thread = new std::thread(&Octree::setImage, this, image);
 	}
 
 	void Octree::setImage(MemImage* image)
+	{
+		OctreeMemoryManager::Use use(this);
+		buildFromImage(image);
+	}
+
+	void Octree::buildFromImage(MemImage* image)
 	{
 		m_usable = false;
 
 		Timer t;
 		m_scale = (double)((1 << (8 * image->typeSize())) - 1);
-		int nx = createLayerGrid(image->width(), m_gridX);
-		int ny = createLayerGrid(image->height(), m_gridY);
-		int nz = createLayerGrid(image->slices(), m_gridZ);
+		createLayers(image->width(), image->height(), image->slices());
+		m_image = image;
+
+		// Fill the damn thing
+		try
+		{
+			if (image->type() == Image::USHORT)
+				fill<unsigned short>(reinterpret_cast<TypedImage<unsigned short>*>(image));
+			else if (image->type() == Image::UBYTE)
+				fill<unsigned char>(reinterpret_cast<TypedImage<unsigned char>*>(image));
+			if (m_hashing)
+				computeHashes();
+
+			LOG_DEBUG("Octree computation completed in " << t.passed() << " ms");
+
+			m_usable = true;
+		}
+		catch (ThreadAbortedException&)
+		{
+			LOG_DEBUG("Octree computation aborted");
+		}
+	}
+
+	void Octree::setMask(TypedImage<unsigned char>* mask)
+	{
+		OctreeMemoryManager::Use use(this);
+		m_usable = false;
+
+		Timer t;
+		m_scale = 1.0;
+		createLayers(mask->width(), mask->height(), mask->slices());
+
+		try
+		{
+			fillMask(mask);
+			propagateLayers();
+
+			LOG_DEBUG("Octree mask computation completed in " << t.passed() << " ms");
+
+			m_usable = true;
+		}
+		catch (ThreadAbortedException&)
+		{
+			LOG_DEBUG("Octree computation aborted");
+		}
+	}
+
+	void Octree::setBricks(int width, int height, int slices, int typeSize, int brickSize, const std::vector<int>& bricks)
+	{
+		OctreeMemoryManager::Use use(this);
+		m_usable = false;
+
+		if (brickSize <= 0) {
+			LOG_DEBUG("Octree brick size " << brickSize << " is invalid");
+			return;
+		}
+		int bx = (width + brickSize - 1) / brickSize;
+		int by = (height + brickSize - 1) / brickSize;
+		int bz = (slices + brickSize - 1) / brickSize;
+		if ((int)bricks.size() != 2 * bx * by * bz) {
+			LOG_DEBUG("Octree brick grid " << bx << " x " << by << " x " << bz << " does not match " << bricks.size() / 2 << " bricks");
+			return;
+		}
+
+		Timer t;
+		m_scale = (double)((1 << (8 * typeSize)) - 1);
+		createLayers(width, height, slices);
+
+		// Fill the highest layer from all bricks overlapping each cell
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+		parallelFor(0, nz, [&](int z) {
+			int z0 = m_offsetZ[leaf][z] / brickSize, z1 = (m_offsetZ[leaf][z] + m_gridZ[leaf][z] - 1) / brickSize;
+			for (int y = 0; y < ny; y++) {
+				int y0 = m_offsetY[leaf][y] / brickSize, y1 = (m_offsetY[leaf][y] + m_gridY[leaf][y] - 1) / brickSize;
+				for (int x = 0; x < nx; x++) {
+					int x0 = m_offsetX[leaf][x] / brickSize, x1 = (m_offsetX[leaf][x] + m_gridX[leaf][x] - 1) / brickSize;
+					OctreeElement& element = m_data[leaf][x + nx * (y + ny * z)];
+					for (int zz = z0; zz <= z1; zz++)
+						for (int yy = y0; yy <= y1; yy++)
+							for (int xx = x0; xx <= x1; xx++) {
+								int brick = 2 * (xx + bx * (yy + by * zz));
+								element.min = std::min(element.min, bricks[brick]);
+								element.max = std::max(element.max, bricks[brick + 1]);
+							}
+				}
+			}
+		});
+		propagateLayers();
+
+		LOG_DEBUG("Octree computation from " << bx * by * bz << " bricks completed in " << t.passed() << " ms");
+		m_usable = true;
+	}
+
+	void Octree::setSource(int width, int height, int slices, const BlockSource& source, double scale)
+	{
+		OctreeMemoryManager::Use use(this);
+		m_usable = false;
+
+		Timer t;
+		m_scale = scale;
+		createLayers(width, height, slices);
+
+		// Evaluate the source for every leaf cell
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+		parallelFor(0, nz, [&](int z) {
+			std::vector<int> values;
+			for (int y = 0; y < ny && !m_abortThread; y++) {
+				for (int x = 0; x < nx; x++) {
+					int sx = m_gridX[leaf][x], sy = m_gridY[leaf][y], sz = m_gridZ[leaf][z];
+					values.resize(sx * sy * sz);
+					source(m_offsetX[leaf][x], m_offsetY[leaf][y], m_offsetZ[leaf][z], sx, sy, sz, &values[0]);
+					OctreeElement& element = m_data[leaf][x + nx * (y + ny * z)];
+					for (int value : values) {
+						element.min = std::min(element.min, value);
+						element.max = std::max(element.max, value);
+					}
+				}
+			}
+		});
+
+		try
+		{
+			if (m_abortThread)
+				throw ThreadAbortedException();
+			propagateLayers();
+
+			LOG_DEBUG("Octree computation from source completed in " << t.passed() << " ms");
+
+			m_usable = true;
+		}
+		catch (ThreadAbortedException&)
+		{
+			LOG_DEBUG("Octree computation aborted");
+		}
+	}
+
+	void Octree::createLayers(int width, int height, int slices)
+	{
+		// Release a previous geometry, if any
+		for (auto layer : m_data)
+			delete[] layer;
+		clearLayerState();
+		m_data.clear();
+		m_counts.clear();
+		m_gridX.clear();
+		m_gridY.clear();
+		m_gridZ.clear();
+
+		int nx = createLayerGrid(width, m_gridX);
+		int ny = createLayerGrid(height, m_gridY);
+		int nz = createLayerGrid(slices, m_gridZ);
 		m_numLayers = std::max(std::max(nx, ny), nz);
 		LOG_DEBUG("Octree layers " << nx << " x " << ny << " x " << nz);
 
@@ -50,33 +555,29 @@ namespace Fusion
 		while (nx < m_numLayers) { m_gridX.push_back(m_gridX[nx - 1]); nx++; }
 		while (ny < m_numLayers) { m_gridY.push_back(m_gridY[ny - 1]); ny++; }
 		while (nz < m_numLayers) { m_gridZ.push_back(m_gridZ[nz - 1]); nz++; }
+		createLayerOffsets(m_gridX, m_offsetX);
+		createLayerOffsets(m_gridY, m_offsetY);
+		createLayerOffsets(m_gridZ, m_offsetZ);
 
 		// Allocate data
 		int lx = 0, ly = 0, lz = 0;
 		for (int i = 0; i < m_numLayers; i++) {
 			int size = (int)(m_gridX[lx].size() * m_gridY[ly].size() * m_gridZ[lz].size());
 			m_data.push_back(new OctreeElement[size]);
+			m_counts.push_back(std::vector<InsideCount>(size));
 			if (lx < nx - 1) lx++;
 			if (ly < ny - 1) ly++;
 			if (lz < nz - 1) lz++;
 		}
+	}
 
-		// Fill the damn thing
-		try
-		{
-			if (image->type() == Image::USHORT)
-				fill<unsigned short>(reinterpret_cast<TypedImage<unsigned short>*>(image));
-			else if (image->type() == Image::UBYTE)
-				fill<unsigned char>(reinterpret_cast<TypedImage<unsigned char>*>(image));
-
-			LOG_DEBUG("Octree computation completed in " << t.passed() << " ms");
-
-			m_usable = true;
-		}
-		catch (ThreadAbortedException&)
-		{
-			LOG_DEBUG("Octree computation aborted");
-		}
+	void Octree::clearLayerState()
+	{
+		m_image = 0;
+		m_classified = false;
+		m_hashes.clear();
+		m_ranges.clear();
+		m_rangeMasks.clear();
 	}
 
 	Octree::~Octree()
@@ -89,6 +590,125 @@ namespace Fusion
 			}
 			delete m_thread;
 		}
+		OctreeMemoryManager::instance().remove(this);
+		for (auto layer : m_data)
+			delete[] layer;
+	}
+
+
+	size_t Octree::getMemoryUsage() const {
+		size_t bytes = 0;
+		for (int layer = 0; layer < (int)m_data.size(); layer++) {
+			if (m_data[layer])
+				bytes += m_gridX[layer].size() * m_gridY[layer].size() * m_gridZ[layer].size() * sizeof(OctreeElement);
+			bytes += m_counts[layer].capacity() * sizeof(InsideCount);
+		}
+		for (const auto& layer : m_rangeMasks)
+			bytes += layer.capacity() * sizeof(RangeMask);
+		for (const auto& layer : m_hashes)
+			bytes += layer.capacity() * sizeof(uint64_t);
+		return bytes;
+	}
+
+
+	void Octree::releaseLayers() {
+		// Keep the classification as its range, or as Morton intervals if it came from elsewhere
+		if (m_classified && m_min > m_max)
+			m_releasedIntervals = collectMortonIntervals();
+		// The two finest layers hold nearly all the memory, coarser layers stay as they are
+		for (int layer = std::max(1, m_numLayers - 2); layer < m_numLayers; layer++) {
+			delete[] m_data[layer];
+			m_data[layer] = 0;
+			std::vector<InsideCount>().swap(m_counts[layer]);
+			if (!m_rangeMasks.empty())
+				std::vector<RangeMask>().swap(m_rangeMasks[layer]);
+			if (!m_hashes.empty())
+				std::vector<uint64_t>().swap(m_hashes[layer]);
+		}
+		m_released = true;
+	}
+
+
+	void Octree::restoreLayers() {
+		Timer t;
+		int first = 1;
+		while (first < m_numLayers && m_data[first])
+			first++;
+		if (first == m_numLayers) {
+			// A single layer Octree has nothing released
+			m_released = false;
+			return;
+		}
+		for (int layer = first; layer < m_numLayers; layer++) {
+			size_t size = m_gridX[layer].size() * m_gridY[layer].size() * m_gridZ[layer].size();
+			m_data[layer] = new OctreeElement[size];
+			m_counts[layer].resize(size);
+			if (!m_rangeMasks.empty())
+				m_rangeMasks[layer].resize(size);
+			if (!m_hashes.empty())
+				m_hashes[layer].resize(size);
+		}
+
+		// Refill the leaf cells from the image, then the other released layers from their children
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		parallelFor(0, (int)m_gridZ[leaf].size(), [&](int z) {
+			for (int y = 0; y < ny; y++)
+				for (int x = 0; x < nx; x++) {
+					if (m_image->type() == Image::USHORT)
+						fillLeaf<unsigned short>(reinterpret_cast<TypedImage<unsigned short>*>(m_image), x, y, z);
+					else if (m_image->type() == Image::UBYTE)
+						fillLeaf<unsigned char>(reinterpret_cast<TypedImage<unsigned char>*>(m_image), x, y, z);
+					if (!m_hashes.empty())
+						m_hashes[leaf][x + nx * (y + ny * z)] = hashLeaf(m_image, x, y, z);
+				}
+		});
+		for (int layer = leaf - 1; layer >= first; layer--)
+			for (int z = 0; z < (int)m_gridZ[layer].size(); z++)
+				for (int y = 0; y < (int)m_gridY[layer].size(); y++)
+					for (int x = 0; x < (int)m_gridX[layer].size(); x++) {
+						updateFromChildren(layer, x, y, z);
+						if (!m_hashes.empty())
+							updateHashFromChildren(layer, x, y, z);
+					}
+
+		// The kept layers still hold their classification and batch masks, redo both below them
+		int kept = first - 1;
+		bool range = m_classified && m_min <= m_max;
+		int voxelsInside = m_voxelsInside;
+		RangePredicate predicate = { m_min, m_max };
+		std::vector<RangeStatistics> statistics(m_ranges.size());
+		int kx = (int)m_gridX[kept].size();
+		int ky = (int)m_gridY[kept].size();
+		int nxx, nyy, nzz; getSplit(kept, nxx, nyy, nzz);
+		for (int z = 0; z < (int)m_gridZ[kept].size(); z++)
+			for (int y = 0; y < ky; y++)
+				for (int x = 0; x < kx; x++) {
+					int index = x + kx * (y + ky * z);
+					ElementType type = m_data[kept][index].type;
+					if (range && type != NODE)
+						setChildrenType(kept, x, y, z, type);
+					uint64_t active = m_rangeMasks.empty() ? 0 : m_rangeMasks[kept][index].in | m_rangeMasks[kept][index].node;
+					for (int zz = 0; zz < nzz; zz++)
+						for (int yy = 0; yy < nyy; yy++)
+							for (int xx = 0; xx < nxx; xx++) {
+								int cx = nxx * x + xx, cy = nyy * y + yy, cz = nzz * z + zz;
+								if (range && type == NODE)
+									checkChildren(predicate, first, cx, cy, cz);
+								if (active)
+									classifyRangeChildren(first, cx, cy, cz, active, statistics);
+							}
+				}
+		m_voxelsInside = voxelsInside;
+		// A classification from elsewhere was kept as intervals
+		if (m_classified && m_min > m_max) {
+			m_voxelsInside = 0;
+			importChildren(0, 0, 0, 0, m_releasedIntervals);
+		}
+		std::vector<uint64_t>().swap(m_releasedIntervals);
+		m_released = false;
+		LOG_DEBUG("Octree restored " << m_numLayers - first << " layers in " << t.passed() << " ms");
 	}
 
 
@@ -116,170 +736,842 @@ namespace Fusion
 	}
 
 
+	void Octree::createLayerOffsets(const std::vector<std::vector<int> >& grid, std::vector<std::vector<int> >& offsets) {
+		offsets.clear();
+		for (const auto& layer : grid)
+		{
+			std::vector<int> positions;
+			int pos = 0;
+			for (int size : layer)
+			{
+				positions.push_back(pos);
+				pos += size;
+			}
+			offsets.push_back(positions);
+		}
+	}
+
+
 	template<typename T> void Octree::fill(TypedImage<T>* image) {
 		m_usable = false;
 
-		std::vector<int> lx = m_gridX[m_numLayers - 1];
-		std::vector<int> ly = m_gridY[m_numLayers - 1];
-		std::vector<int> lz = m_gridZ[m_numLayers - 1];
-		int nx = (int)lx.size();
-		int ny = (int)ly.size();
-		int nz = (int)lz.size();
-		T* imgPtr = image->pointer();
-		int elementPos = 0;
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
 
 		// Fill the highest layer from image data
-		int pz = 0;
 		for (int z = 0; z < nz; z++)
 		{
-			int py = 0;
-
 			if (m_abortThread)
 				throw ThreadAbortedException();
 
-			for (int y = 0; y < ny; y++) {
-				int px = 0;
-				for (int x = 0; x < nx; x++) {
-					OctreeElement& element = m_data[m_numLayers - 1][elementPos++];
-					for (int zz = 0; zz < lz[z]; zz++) {
-						for (int yy = 0; yy < ly[y]; yy++) {
-							for (int xx = 0; xx < lx[x]; xx++) {
-								int value = (int)imgPtr[px + xx + image->width() * (py + yy + image->height() * (pz + zz))];
-								element.min = std:min(element.min, value);
-								element.max = std:max(element.max, value);
+			for (int y = 0; y < ny; y++)
+				for (int x = 0; x < nx; x++)
+					fillLeaf(image, x, y, z);
+		}
+
+		// Propagate up to the other layers
+		propagateLayers();
+
+		m_usable = true;
+	}
+
+
+	void Octree::fillMask(TypedImage<unsigned char>* mask) {
+		int leaf = m_numLayers - 1;
+		const std::vector<int>& lx = m_gridX[leaf];
+		const std::vector<int>& ly = m_gridY[leaf];
+		int nx = (int)lx.size();
+		int ny = (int)ly.size();
+		int nz = (int)m_gridZ[leaf].size();
+		int width = mask->width();
+		int height = mask->height();
+		int numWords = (width + 63) / 64;
+		const unsigned char* imgPtr = mask->pointer();
+
+		// Every slab of leaf cells in z is handled independently
+		parallelFor(0, nz, [&](int z) {
+			if (m_abortThread)
+				return;
+			std::vector<uint64_t> words((size_t)numWords * height);
+			std::vector<char> any(nx * ny, 0), all(nx * ny, 1);
+			for (int vz = m_offsetZ[leaf][z]; vz < m_offsetZ[leaf][z] + m_gridZ[leaf][z]; vz++) {
+				for (int vy = 0; vy < height; vy++)
+					packMaskRow(imgPtr + (size_t)width * (vy + (size_t)height * vz), width, &words[(size_t)numWords * vy]);
+				for (int y = 0; y < ny; y++) {
+					for (int x = 0; x < nx; x++) {
+						// Bit masks of the first and last word covered by the cell
+						int x0 = m_offsetX[leaf][x], x1 = x0 + lx[x] - 1;
+						uint64_t firstMask = ~0ULL << (x0 & 63);
+						uint64_t lastMask = ~0ULL >> (63 - (x1 & 63));
+						bool cellAny = false, cellAll = true;
+						for (int vy = m_offsetY[leaf][y]; vy < m_offsetY[leaf][y] + ly[y]; vy++) {
+							const uint64_t* row = &words[(size_t)numWords * vy];
+							for (int w = x0 >> 6; w <= x1 >> 6; w++) {
+								uint64_t cellMask = ~0ULL;
+								if (w == x0 >> 6) cellMask &= firstMask;
+								if (w == x1 >> 6) cellMask &= lastMask;
+								uint64_t bits = row[w] & cellMask;
+								cellAny |= bits != 0;
+								cellAll &= bits == cellMask;
 							}
 						}
+						any[x + nx * y] |= cellAny;
+						all[x + nx * y] &= cellAll;
 					}
-					px += lx[x];
 				}
-				py += ly[y];
 			}
-			pz += lz[z];
-		}
+			OctreeElement* element = &m_data[leaf][nx * ny * z];
+			for (int i = 0; i < nx * ny; i++) {
+				element[i].min = all[i] ? 1 : 0;
+				element[i].max = any[i] ? 1 : 0;
+			}
+		});
+		if (m_abortThread)
+			throw ThreadAbortedException();
+	}
 
-		// Propagate up to the other layers
+
+	void Octree::propagateLayers() {
 		for (int layer = m_numLayers - 2; layer >= 0; layer--)
 		{
-			nx = (int)m_gridX[layer].size();
-			ny = (int)m_gridY[layer].size();
-			nz = (int)m_gridZ[layer].size();
-			elementPos = 0;
+			int nx = (int)m_gridX[layer].size();
+			int ny = (int)m_gridY[layer].size();
+			int nz = (int)m_gridZ[layer].size();
 			for (int z = 0; z < nz; z++) {
 				if (m_abortThread)
 					throw ThreadAbortedException();
 
-				for (int y = 0; y < ny; y++) {
-					for (int x = 0; x < nx; x++) {
-						// Determine if one or two cubes per dimension are present in the layer below
-						int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
-						// Fill element properties from its children
-						OctreeElement& elementUp = m_data[layer][elementPos++];
-						for (int zz = 0; zz < nzz; zz++) {
-							for (int yy = 0; yy < nyy; yy++) {
-								for (int xx = 0; xx < nxx; xx++) {
-									int indexDown = nxx * x + xx + nx * nxx * (nyy * y + yy + ny * nyy * (nzz * z + zz));
-									OctreeElement& elementDown = m_data[layer + 1][indexDown];
-									if (elementUp.min > elementDown.min) elementUp.min = elementDown.min;
-									if (elementUp.max < elementDown.max) elementUp.max = elementDown.max;
-								}
-							}
-						}
-					}
+				for (int y = 0; y < ny; y++)
+					for (int x = 0; x < nx; x++)
+						updateFromChildren(layer, x, y, z);
+			}
+		}
+	}
+
+
+	void Octree::updateFromChildren(int layer, int px, int py, int pz) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		// Determine if one or two cubes per dimension are present in the layer below
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		// Fill element properties from its children
+		OctreeElement& elementUp = m_data[layer][px + nx * (py + ny * pz)];
+		elementUp.min = std::numeric_limits<int>::max();
+		elementUp.max = std::numeric_limits<int>::min();
+		for (int zz = 0; zz < nzz; zz++) {
+			for (int yy = 0; yy < nyy; yy++) {
+				for (int xx = 0; xx < nxx; xx++) {
+					int indexDown = nxx * px + xx + nx * nxx * (nyy * py + yy + ny * nyy * (nzz * pz + zz));
+					OctreeElement& elementDown = m_data[layer + 1][indexDown];
+					if (elementUp.min > elementDown.min) elementUp.min = elementDown.min;
+					if (elementUp.max < elementDown.max) elementUp.max = elementDown.max;
 				}
 			}
 		}
+	}
 
-		m_usable = true;
+
+	void Octree::updateLeaves(const std::vector<int>& leaves) {
+		int leaf = m_numLayers - 1;
+		std::vector<int> dirty = leaves;
+		for (int layer = leaf; layer >= 0; layer--) {
+			int nx = (int)m_gridX[layer].size();
+			int ny = (int)m_gridY[layer].size();
+			if (layer == leaf) {
+				// Fill the leaf cells from the image in parallel
+				parallelFor(0, (int)dirty.size(), [&](int i) {
+					int index = dirty[i];
+					int px = index % nx, py = (index / nx) % ny, pz = index / (nx * ny);
+					if (m_image->type() == Image::USHORT)
+						fillLeaf<unsigned short>(reinterpret_cast<TypedImage<unsigned short>*>(m_image), px, py, pz);
+					else if (m_image->type() == Image::UBYTE)
+						fillLeaf<unsigned char>(reinterpret_cast<TypedImage<unsigned char>*>(m_image), px, py, pz);
+				});
+			}
+			else {
+				for (int index : dirty) {
+					updateFromChildren(layer, index % nx, (index / nx) % ny, index / (nx * ny));
+					if (!m_hashes.empty())
+						updateHashFromChildren(layer, index % nx, (index / nx) % ny, index / (nx * ny));
+				}
+			}
+			if (layer == 0)
+				break;
+
+			// Collect the parents of all updated elements
+			int nxx, nyy, nzz; getSplit(layer - 1, nxx, nyy, nzz);
+			int pnx = (int)m_gridX[layer - 1].size();
+			int pny = (int)m_gridY[layer - 1].size();
+			std::vector<int> parents;
+			for (int index : dirty)
+				parents.push_back(index % nx / nxx + pnx * ((index / nx) % ny / nyy + pny * (index / (nx * ny) / nzz)));
+			std::sort(parents.begin(), parents.end());
+			parents.erase(std::unique(parents.begin(), parents.end()), parents.end());
+			dirty.swap(parents);
+		}
 	}
 
 
-	bool Octree::setInsideRange(int min, int max) {
-		if ((m_min == min) && (m_max == max))
-			return false;
-		m_min = min; m_max = max;
-		m_voxelsInside = 0;
-		Timer t;
-		// Recurse into Octree
-		checkChildren(0, 0, 0, 0);
-		// Print statistics
-		int numVoxels = m_gridX[0][0] * m_gridY[0][0] * m_gridZ[0][0];
-		double percentage = 100.0 * (double)m_voxelsInside / (double)numVoxels;
-		LOG_DEBUG("Octree range [" << m_min << ".." << m_max << "], " << percentage << "% inside, " << t.passed() << " ms");
-		return true;
+	template<typename T> void Octree::fillLeaf(TypedImage<T>* image, int px, int py, int pz) {
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		const T* imgPtr = image->pointer();
+		OctreeElement& element = m_data[leaf][px + nx * (py + ny * pz)];
+		element.min = std::numeric_limits<int>::max();
+		element.max = std::numeric_limits<int>::min();
+		for (int zz = m_offsetZ[leaf][pz]; zz < m_offsetZ[leaf][pz] + m_gridZ[leaf][pz]; zz++) {
+			for (int yy = m_offsetY[leaf][py]; yy < m_offsetY[leaf][py] + m_gridY[leaf][py]; yy++) {
+				const T* row = imgPtr + image->width() * (yy + (size_t)image->height() * zz);
+				for (int xx = m_offsetX[leaf][px]; xx < m_offsetX[leaf][px] + m_gridX[leaf][px]; xx++) {
+					element.min = std::min(element.min, (int)row[xx]);
+					element.max = std::max(element.max, (int)row[xx]);
+				}
+			}
+		}
 	}
 
 
-	bool Octree::setInsideRange(double min, double max) {
-		// TODO: More appropriate rounding
-		return setInsideRange(int(min * m_scale), int(max * m_scale));
+	uint64_t Octree::hashLeaf(const MemImage* image, int px, int py, int pz) const {
+		int leaf = m_numLayers - 1;
+		int typeSize = image->typeSize();
+		int width = image->width();
+		int height = image->height();
+		const unsigned char* bytes = (image->type() == Image::USHORT) ?
+			reinterpret_cast<const unsigned char*>(reinterpret_cast<const TypedImage<unsigned short>*>(image)->pointer()) :
+			reinterpret_cast<const unsigned char*>(reinterpret_cast<const TypedImage<unsigned char>*>(image)->pointer());
+		// Chain the hashes of all rows of the cell
+		uint64_t hash = 0;
+		for (int zz = m_offsetZ[leaf][pz]; zz < m_offsetZ[leaf][pz] + m_gridZ[leaf][pz]; zz++) {
+			for (int yy = m_offsetY[leaf][py]; yy < m_offsetY[leaf][py] + m_gridY[leaf][py]; yy++) {
+				size_t start = m_offsetX[leaf][px] + width * (yy + (size_t)height * zz);
+				hash = hashBytes(bytes + typeSize * start, typeSize * m_gridX[leaf][px], hash);
+			}
+		}
+		return hash;
 	}
 
 
-	Octree::ElementType Octree::checkChildren(int layer, int px, int py, int pz) {
+	void Octree::updateHashFromChildren(int layer, int px, int py, int pz) {
 		int nx = (int)m_gridX[layer].size();
 		int ny = (int)m_gridY[layer].size();
-		OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
-		if ((m_min > element.max) || (m_max < element.min))
-			// Current element is outside of requested range, return at any level
-			element.type = LEAF_OUT;
-		else if (layer == m_numLayers - 1) {
-			// Element is inside and on the last level
-			element.type = LEAF_IN;
-			// Update statistics
-			m_voxelsInside += m_gridX[layer][px] * m_gridY[layer][py] * m_gridZ[layer][pz];
-		}
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		uint64_t childHashes[8];
+		int numChildren = 0;
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++)
+					childHashes[numChildren++] = m_hashes[layer + 1][nxx * px + xx + nx * nxx * (nyy * py + yy + ny * nyy * (nzz * pz + zz))];
+		m_hashes[layer][px + nx * (py + ny * pz)] = hashBytes(reinterpret_cast<const unsigned char*>(childHashes), numChildren * sizeof(uint64_t), 0);
+	}
+
+
+	void Octree::computeHashes() {
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+		m_hashes.resize(m_numLayers);
+		for (int layer = 0; layer < m_numLayers; layer++)
+			m_hashes[layer].resize(m_gridX[layer].size() * m_gridY[layer].size() * m_gridZ[layer].size());
+		parallelFor(0, nz, [&](int z) {
+			for (int y = 0; y < ny; y++)
+				for (int x = 0; x < nx; x++)
+					m_hashes[leaf][x + nx * (y + ny * z)] = hashLeaf(m_image, x, y, z);
+		});
+		for (int layer = leaf - 1; layer >= 0; layer--)
+			for (int z = 0; z < (int)m_gridZ[layer].size(); z++)
+				for (int y = 0; y < (int)m_gridY[layer].size(); y++)
+					for (int x = 0; x < (int)m_gridX[layer].size(); x++)
+						updateHashFromChildren(layer, x, y, z);
+	}
+
+
+	int Octree::refresh() {
+		OctreeMemoryManager::Use use(this);
+		if (!m_usable || !m_image || m_hashes.empty())
+			return 0;
+
+		Timer t;
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+		std::vector<std::vector<int> > slabs(nz);
+		parallelFor(0, nz, [&](int z) {
+			for (int y = 0; y < ny; y++) {
+				for (int x = 0; x < nx; x++) {
+					int index = x + nx * (y + ny * z);
+					uint64_t hash = hashLeaf(m_image, x, y, z);
+					if (hash != m_hashes[leaf][index]) {
+						m_hashes[leaf][index] = hash;
+						slabs[z].push_back(index);
+					}
+				}
+			}
+		});
+		std::vector<int> changed;
+		for (const auto& slab : slabs)
+			changed.insert(changed.end(), slab.begin(), slab.end());
+
+		if (!changed.empty()) {
+			updateLeaves(changed);
+			// Re-apply the current range, unless the classification came from elsewhere
+			if (m_classified && m_min <= m_max) {
+				int min = m_min, max = m_max;
+				m_min = std::numeric_limits<int>::max();
+				m_max = std::numeric_limits<int>::min();
+				setInsideRange(min, max);
+			}
+			// Batch masks depend on the changed bounds as well, a full pass costs little next to rehashing the image
+			if (!m_ranges.empty())
+				classifyRanges(m_ranges);
+		}
+		LOG_DEBUG("Octree refresh found " << changed.size() << " changed cells in " << t.passed() << " ms");
+		return (int)changed.size();
+	}
+
+
+	std::vector<int> Octree::diff(const Octree& other) const {
+		OctreeMemoryManager::Use use(this);
+		OctreeMemoryManager::Use otherUse(&other);
+		std::vector<int> boxes;
+		if (m_gridX != other.m_gridX || m_gridY != other.m_gridY || m_gridZ != other.m_gridZ) {
+			LOG_DEBUG("Octree diff requires the same geometry");
+			return boxes;
+		}
+		Timer t;
+		diffChildren(other, 0, 0, 0, 0, boxes);
+		LOG_DEBUG("Octree diff found " << boxes.size() / 6 << " changed boxes in " << t.passed() << " ms");
+		return boxes;
+	}
+
+
+	std::vector<int> Octree::diff(MemImage* image) const {
+		OctreeMemoryManager::Use use(this);
+		std::vector<int> boxes;
+		if (m_hashes.empty() || image->width() != m_gridX[0][0] || image->height() != m_gridY[0][0] || image->slices() != m_gridZ[0][0]) {
+			LOG_DEBUG("Octree diff requires hashing and the same geometry");
+			return boxes;
+		}
+		Timer t;
+		// Hash the new image per leaf cell in parallel and compare
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+		std::vector<char> changed(nx * ny * nz);
+		parallelFor(0, nz, [&](int z) {
+			for (int y = 0; y < ny; y++)
+				for (int x = 0; x < nx; x++) {
+					int index = x + nx * (y + ny * z);
+					changed[index] = hashLeaf(image, x, y, z) != m_hashes[leaf][index];
+				}
+		});
+		changedChildren(changed, 0, 0, 0, 0, boxes);
+		LOG_DEBUG("Octree diff found " << boxes.size() / 6 << " changed boxes in " << t.passed() << " ms");
+		return boxes;
+	}
+
+
+	bool Octree::diffChildren(const Octree& other, int layer, int px, int py, int pz, std::vector<int>& boxes) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		int index = px + nx * (py + ny * pz);
+		const OctreeElement& element = m_data[layer][index];
+		const OctreeElement& otherElement = other.m_data[layer][index];
+		bool hashed = !m_hashes.empty() && !other.m_hashes.empty();
+		bool sameBounds = element.min == otherElement.min && element.max == otherElement.max;
+		if (sameBounds && (!hashed || m_hashes[layer][index] == other.m_hashes[layer][index])) {
+			// Without hashes only the leaf bounds can tell a difference
+			if (hashed || layer == m_numLayers - 1)
+				return false;
+		}
+		if (layer == m_numLayers - 1) {
+			appendBox(layer, px, py, pz, boxes);
+			return true;
+		}
+		// Something differs, need to check children
+		size_t start = boxes.size();
+		bool allChanged = true;
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++)
+					allChanged &= diffChildren(other, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, boxes);
+		if (allChanged) {
+			// Replace the boxes of all children by a single one
+			boxes.resize(start);
+			appendBox(layer, px, py, pz, boxes);
+		}
+		return allChanged;
+	}
+
+
+	bool Octree::changedChildren(const std::vector<char>& changed, int layer, int px, int py, int pz, std::vector<int>& boxes) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		if (layer == m_numLayers - 1) {
+			if (!changed[px + nx * (py + ny * pz)])
+				return false;
+			appendBox(layer, px, py, pz, boxes);
+			return true;
+		}
+		size_t start = boxes.size();
+		bool allChanged = true;
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++)
+					allChanged &= changedChildren(changed, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, boxes);
+		if (allChanged) {
+			// Replace the boxes of all children by a single one
+			boxes.resize(start);
+			appendBox(layer, px, py, pz, boxes);
+		}
+		return allChanged;
+	}
+
+
+	void Octree::appendBox(int layer, int px, int py, int pz, std::vector<int>& boxes) const {
+		boxes.push_back(m_offsetX[layer][px]);
+		boxes.push_back(m_offsetY[layer][py]);
+		boxes.push_back(m_offsetZ[layer][pz]);
+		boxes.push_back(m_gridX[layer][px]);
+		boxes.push_back(m_gridY[layer][py]);
+		boxes.push_back(m_gridZ[layer][pz]);
+	}
+
+
+	bool Octree::setInsideRange(int min, int max) {
+		OctreeMemoryManager::Use use(this);
+		if ((m_min == min) && (m_max == max))
+			return false;
+		m_min = min; m_max = max;
+		m_classified = true;
+		m_voxelsInside = 0;
+		Timer t;
+		// Recurse into Octree
+		RangePredicate predicate = { m_min, m_max };
+		checkChildren(predicate, 0, 0, 0, 0);
+		// Print statistics
+		int numVoxels = m_gridX[0][0] * m_gridY[0][0] * m_gridZ[0][0];
+		double percentage = 100.0 * (double)m_voxelsInside / (double)numVoxels;
+		LOG_DEBUG("Octree range [" << m_min << ".." << m_max << "], " << percentage << "% inside, " << t.passed() << " ms");
+		return true;
+	}
+
+
+	bool Octree::setInsideRange(double min, double max) {
+		int storedMin, storedMax;
+		getStoredRange(min, max, storedMin, storedMax);
+		return setInsideRange(storedMin, storedMax);
+	}
+
+
+	void Octree::getStoredRange(double min, double max, int& storedMin, int& storedMax) const {
+		if (m_mapping.slope != 0)
+			m_mapping.toStored(min, max, storedMin, storedMax);
 		else {
-			// Something else, need to check children
+			// TODO: More appropriate rounding
+			storedMin = int(min * m_scale);
+			storedMax = int(max * m_scale);
+		}
+	}
+
+
+	void Octree::IntensityMapping::toStored(double low, double high, int& min, int& max) const {
+		const double lowest = std::numeric_limits<int>::min(), highest = std::numeric_limits<int>::max();
+		if (slope == 0) {
+			// Every stored value maps to the intercept
+			bool all = low <= intercept && intercept <= high;
+			min = all ? std::numeric_limits<int>::min() : std::numeric_limits<int>::max();
+			max = all ? std::numeric_limits<int>::max() : std::numeric_limits<int>::min();
+			return;
+		}
+		// A negative slope reverses the order, the high bound gives the smallest stored value
+		double first = slope > 0 ? low : high, last = slope > 0 ? high : low;
+		min = (int)std::min(std::max(std::ceil((first - intercept) / slope), lowest), highest);
+		max = (int)std::min(std::max(std::floor((last - intercept) / slope), lowest), highest);
+		// The division may be off by one, correct against the mapping itself
+		auto maps = [&](int64_t value) { double rescaled = slope * value + intercept; return rescaled >= low && rescaled <= high; };
+		if (min <= max && !maps(min)) min++;
+		if (min <= max && !maps(max)) max--;
+		if (min > lowest && maps((int64_t)min - 1)) min--;
+		if (max < highest && maps((int64_t)max + 1)) max++;
+	}
+
+
+	std::vector<Octree::RangeStatistics> Octree::classifyRanges(const std::vector<std::pair<int, int> >& ranges) {
+		OctreeMemoryManager::Use use(this);
+		m_ranges = ranges;
+		if (m_ranges.size() > 64) {
+			LOG_DEBUG("Octree batch classification limited to 64 of " << m_ranges.size() << " ranges");
+			m_ranges.resize(64);
+		}
+		if (m_rangeMasks.empty())
+			for (int layer = 0; layer < m_numLayers; layer++)
+				m_rangeMasks.push_back(std::vector<RangeMask>(m_counts[layer].size()));
+
+		Timer timer;
+		RangeStatistics empty = { 0, 0 };
+		std::vector<RangeStatistics> statistics(m_ranges.size(), empty);
+		if (!m_ranges.empty()) {
+			uint64_t active = m_ranges.size() == 64 ? ~0ULL : (1ULL << m_ranges.size()) - 1;
+			uint64_t in = classifyRangeChildren(0, 0, 0, 0, active, statistics).in;
+			// Ranges with the root inside produce a single cube
+			for (uint64_t bits = in; bits; bits &= bits - 1)
+				statistics[lowestBit(bits)].cubes++;
+		}
+		LOG_DEBUG("Octree classified " << m_ranges.size() << " ranges in " << timer.passed() << " ms");
+		return statistics;
+	}
+
+
+	Octree::RangeEstimate Octree::estimateRange(int min, int max, int numSamples, unsigned int seed) const {
+		OctreeMemoryManager::Use use(this);
+		RangeEstimate estimate = { 0.0, 0.0, 0, 0, 0.0, 0.0, 0, 0 };
+
+		// The deepest layer with few enough elements to be visited completely
+		int coarse = 0;
+		while (coarse < m_numLayers - 1 && m_gridX[coarse + 1].size() * m_gridY[coarse + 1].size() * m_gridZ[coarse + 1].size() <= 4096)
+			coarse++;
+		int nx = (int)m_gridX[coarse].size();
+		int ny = (int)m_gridY[coarse].size();
+		int nz = (int)m_gridZ[coarse].size();
+
+		// Decide elements entirely outside or inside exactly, collect the others
+		std::vector<char> states(nx * ny * nz);
+		std::vector<int> undecided;
+		int64_t undecidedVoxels = 0;
+		for (int z = 0; z < nz; z++) {
+			for (int y = 0; y < ny; y++) {
+				for (int x = 0; x < nx; x++) {
+					int index = x + nx * (y + ny * z);
+					const OctreeElement& element = m_data[coarse][index];
+					int64_t voxels = (int64_t)m_gridX[coarse][x] * m_gridY[coarse][y] * m_gridZ[coarse][z];
+					if ((min > max) || (min > element.max) || (max < element.min))
+						states[index] = LEAF_OUT;
+					else if (((min <= element.min) && (max >= element.max)) || coarse == m_numLayers - 1) {
+						states[index] = LEAF_IN;
+						estimate.minVoxels += voxels;
+					}
+					else {
+						states[index] = NODE;
+						undecided.push_back(index);
+						undecidedVoxels += voxels;
+					}
+				}
+			}
+		}
+		// Undecided elements all have the same number of leaves
+		int leaf = m_numLayers - 1;
+		int lnx = (int)m_gridX[leaf].size(), lny = (int)m_gridY[leaf].size();
+		int rx = lnx / nx, ry = lny / ny, rz = (int)m_gridZ[leaf].size() / nz;
+		bool allIn, mayAllIn;
+		estimate.cubes = estimateCubes(states, coarse, 0, 0, 0, 0, (int64_t)rx * ry * rz, allIn, mayAllIn, estimate.minCubes, estimate.maxCubes);
+		estimate.maxVoxels = estimate.minVoxels + undecidedVoxels;
+		estimate.voxels = (double)estimate.minVoxels;
+		if (undecided.empty() || numSamples <= 0) {
+			estimate.voxels += 0.5 * undecidedVoxels;
+			return estimate;
+		}
+
+		// Sample leaves of the undecided elements
+		double numLeaves = (double)undecided.size() * rx * ry * rz;
+		std::mt19937 random(seed);
+		double sumVoxels = 0, sumVoxelsSquared = 0, sumCubes = 0, sumCubesSquared = 0;
+		for (int i = 0; i < numSamples; i++) {
+			int index = undecided[random() % undecided.size()];
+			int x = rx * (index % nx) + (int)(random() % rx);
+			int y = ry * (index / nx % ny) + (int)(random() % ry);
+			int z = rz * (index / nx / ny) + (int)(random() % rz);
+			const OctreeElement& element = m_data[leaf][x + lnx * (y + lny * z)];
+			if ((min > element.max) || (max < element.min))
+				continue;
+			double voxels = (double)m_gridX[leaf][x] * m_gridY[leaf][y] * m_gridZ[leaf][z];
+			sumVoxels += voxels;
+			sumVoxelsSquared += voxels * voxels;
+
+			// Inside leaves merge into the highest ancestor below the coarse layer with all leaves inside, each
+			// contributing its share of that single cube. Leaves are checked for up to two layers above the
+			// last one, beyond that only ancestors with bounds inside the range are merged.
+			int px = x, py = y, pz = z, share = 1;
+			for (int up = leaf - 1; up > coarse; up--) {
+				int sx, sy, sz; getSplit(up, sx, sy, sz);
+				px /= sx; py /= sy; pz /= sz;
+				const OctreeElement& ancestor = m_data[up][px + (int)m_gridX[up].size() * (py + (int)m_gridY[up].size() * pz)];
+				int ax = lnx / (int)m_gridX[up].size(), ay = lny / (int)m_gridY[up].size(), az = (int)m_gridZ[leaf].size() / (int)m_gridZ[up].size();
+				bool merged = (min <= ancestor.min) && (max >= ancestor.max);
+				if (!merged && up >= leaf - 2) {
+					merged = true;
+					for (int lz = az * pz; lz < az * (pz + 1) && merged; lz++)
+						for (int ly = ay * py; ly < ay * (py + 1) && merged; ly++)
+							for (int lx = ax * px; lx < ax * (px + 1) && merged; lx++) {
+								const OctreeElement& other = m_data[leaf][lx + lnx * (ly + lny * lz)];
+								merged = (min <= other.max) && (max >= other.min);
+							}
+				}
+				if (!merged)
+					break;
+				share = ax * ay * az;
+			}
+			double cubes = 1.0 / share;
+			sumCubes += cubes;
+			sumCubesSquared += cubes * cubes;
+		}
+		// Scale sample means and standard errors up to all undecided leaves
+		double meanVoxels = sumVoxels / numSamples;
+		double meanCubes = sumCubes / numSamples;
+		double varianceVoxels = std::max(0.0, sumVoxelsSquared / numSamples - meanVoxels * meanVoxels);
+		double varianceCubes = std::max(0.0, sumCubesSquared / numSamples - meanCubes * meanCubes);
+		estimate.voxels += numLeaves * meanVoxels;
+		estimate.voxelsError = numLeaves * std::sqrt(varianceVoxels / numSamples);
+		estimate.cubesError = numLeaves * std::sqrt(varianceCubes / numSamples);
+		// Merging across undecided elements is not sampled, so at least stay within the guaranteed bounds
+		estimate.cubes = std::min(std::max(estimate.cubes + numLeaves * meanCubes, (double)estimate.minCubes), (double)estimate.maxCubes);
+		return estimate;
+	}
+
+
+	int Octree::estimateCubes(const std::vector<char>& states, int coarse, int layer, int px, int py, int pz, int64_t leaves,
+		bool& allIn, bool& mayAllIn, int64_t& minCubes, int64_t& maxCubes) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		if (layer == coarse) {
+			// An undecided element has anything from no cube to one cube per leaf, and may turn out all inside
+			ElementType state = (ElementType)states[px + nx * (py + ny * pz)];
+			allIn = state == LEAF_IN;
+			mayAllIn = state != LEAF_OUT;
+			minCubes = allIn ? 1 : 0;
+			maxCubes = allIn ? 1 : (state == NODE ? leaves : 0);
+			return allIn ? 1 : 0;
+		}
+		// Children all inside merge into a single cube
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		int cubes = 0;
+		int64_t sumMin = 0, sumMax = 0;
+		allIn = true;
+		mayAllIn = true;
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++) {
+					bool childIn, childMayIn;
+					int64_t childMin, childMax;
+					cubes += estimateCubes(states, coarse, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, leaves, childIn, childMayIn, childMin, childMax);
+					allIn &= childIn;
+					mayAllIn &= childMayIn;
+					sumMin += childMin;
+					sumMax += childMax;
+				}
+		// Either all children merge into one cube, or the element has the cubes of its children
+		minCubes = mayAllIn ? std::min<int64_t>(1, sumMin) : sumMin;
+		maxCubes = allIn ? 1 : sumMax;
+		return allIn ? 1 : cubes;
+	}
+
+
+	Octree::RangeMask Octree::classifyRangeChildren(int layer, int px, int py, int pz, uint64_t active, std::vector<RangeStatistics>& statistics) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		int index = px + nx * (py + ny * pz);
+		const OctreeElement& element = m_data[layer][index];
+		RangeMask& mask = m_rangeMasks[layer][index];
+
+		// Drop all ranges for which the element is outside
+		uint64_t candidates = 0;
+		for (int k = 0; k < (int)m_ranges.size(); k++)
+			candidates |= (uint64_t)((m_ranges[k].first <= m_ranges[k].second) & (m_ranges[k].first <= element.max) & (m_ranges[k].second >= element.min)) << k;
+		candidates &= active;
+
+		if (layer == m_numLayers - 1) {
+			// Element is inside for all remaining ranges on the last level
+			mask.in = candidates;
+			mask.node = 0;
+			int64_t voxels = (int64_t)m_gridX[layer][px] * m_gridY[layer][py] * m_gridZ[layer][pz];
+			for (uint64_t bits = candidates; bits; bits &= bits - 1)
+				statistics[lowestBit(bits)].voxels += voxels;
+		}
+		else if (candidates == 0) {
+			mask.in = 0;
+			mask.node = 0;
+		}
+		else {
+			// Check children for the remaining ranges
 			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
-			bool allIn = true, allOut = true;
+			uint64_t allIn = candidates, anyNotOut = 0;
+			uint64_t childIn[8];
+			int numChildren = 0;
 			for (int zz = 0; zz < nzz; zz++) {
 				for (int yy = 0; yy < nyy; yy++) {
 					for (int xx = 0; xx < nxx; xx++) {
-						ElementType value = checkChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz);
-						if (value == LEAF_IN)		allOut = false;
-						else if (value == LEAF_OUT) allIn = false;
-						else { allIn = false; allOut = false; }
+						RangeMask child = classifyRangeChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, candidates, statistics);
+						childIn[numChildren++] = child.in;
+						allIn &= child.in;
+						anyNotOut |= child.in | child.node;
 					}
 				}
 			}
-			if (allIn)		 element.type = LEAF_IN;
-			else if (allOut) element.type = LEAF_OUT; // This should never happen, but won't hurt to check
-			else			 element.type = NODE;
+			// Children inside for a range where this element is not become cubes of their own
+			for (int i = 0; i < numChildren; i++)
+				for (uint64_t bits = childIn[i] & ~allIn; bits; bits &= bits - 1)
+					statistics[lowestBit(bits)].cubes++;
+			mask.in = allIn;
+			mask.node = anyNotOut & ~allIn;
+		}
+		return mask;
+	}
+
+
+	bool Octree::selectRange(int index) {
+		OctreeMemoryManager::Use use(this);
+		if (index < 0 || index >= (int)m_ranges.size() || m_rangeMasks.empty())
+			return false;
+		if ((m_min == m_ranges[index].first) && (m_max == m_ranges[index].second))
+			return false;
+		m_min = m_ranges[index].first; m_max = m_ranges[index].second;
+		m_classified = true;
+		m_voxelsInside = 0;
+		selectRangeChildren(0, 0, 0, 0, 1ULL << index);
+		return true;
+	}
+
+
+	Octree::ElementType Octree::selectRangeChildren(int layer, int px, int py, int pz, uint64_t bit) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		int index = px + nx * (py + ny * pz);
+		OctreeElement& element = m_data[layer][index];
+		const RangeMask& mask = m_rangeMasks[layer][index];
+		if (mask.in & bit) {
+			// Children are inside as well, write them so no stale type remains below this leaf
+			element.type = LEAF_IN;
+			setChildrenType(layer, px, py, pz, LEAF_IN);
+			m_voxelsInside += m_gridX[layer][px] * m_gridY[layer][py] * m_gridZ[layer][pz];
+		}
+		else if (mask.node & bit) {
+			element.type = NODE;
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						selectRangeChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, bit);
 		}
+		else
+			element.type = LEAF_OUT;
+		updateInsideCount(layer, px, py, pz);
 		return element.type;
 	}
 
 
+	void Octree::setChildrenType(int layer, int px, int py, int pz, ElementType type) {
+		if (layer == m_numLayers - 1)
+			return;
+		int nx = (int)m_gridX[layer + 1].size();
+		int ny = (int)m_gridY[layer + 1].size();
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++) {
+					int cx = nxx * px + xx, cy = nyy * py + yy, cz = nzz * pz + zz;
+					m_data[layer + 1][cx + nx * (cy + ny * cz)].type = type;
+					setChildrenType(layer + 1, cx, cy, cz, type);
+					updateInsideCount(layer + 1, cx, cy, cz);
+				}
+	}
+
+
+	void Octree::updateInsideCount(int layer, int px, int py, int pz) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		int index = px + nx * (py + ny * pz);
+		InsideCount& count = m_counts[layer][index];
+		switch (m_data[layer][index].type) {
+		case LEAF_OUT:
+			count.cubes = 0;
+			count.voxels = 0;
+			break;
+		case LEAF_IN:
+			count.cubes = 1;
+			count.voxels = (int64_t)m_gridX[layer][px] * m_gridY[layer][py] * m_gridZ[layer][pz];
+			break;
+		case NODE: {
+			// Sum up the children, which have been classified before
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			count.cubes = 0;
+			count.voxels = 0;
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++) {
+						const InsideCount& child = m_counts[layer + 1][nxx * px + xx + nx * nxx * (nyy * py + yy + ny * nyy * (nzz * pz + zz))];
+						count.cubes += child.cubes;
+						count.voxels += child.voxels;
+					}
+			break;
+		}
+		}
+	}
+
+
 	const std::vector<int>& Octree::enumerate() {
-		m_cubesInside.clear();
+		OctreeMemoryManager::Use use(this);
 		Timer t; // I do not like one character variables unless it is a counter
-		int num = enumerateChildren(0, 0, 0, 0);
-		LOG_DEBUG("Octree has " << num << " cubes");
+		// The exact number of cubes is known from classification, every subtree writes at its own offset
+		int num = getNumCubesInside();
+		m_cubesInside.resize(6 * num);
+		if (num > 0) {
+			int grain = std::max(1, num / (8 * std::max(1, (int)std::thread::hardware_concurrency())));
+			int offset = 0;
+			std::vector<EnumerationTask> tasks;
+			collectEnumerationTasks(0, 0, 0, 0, grain, offset, tasks);
+			parallelFor(0, (int)tasks.size(), [&](int i) {
+				const EnumerationTask& task = tasks[i];
+				int* cubes = &m_cubesInside[6 * task.offset];
+				enumerateChildren(task.layer, task.px, task.py, task.pz, cubes);
+			});
+		}
+		LOG_DEBUG("Octree has " << num << " cubes, enumerated in " << t.passed() << " ms");
 		return std::move(m_cubesInside);
 	}
 
 
-	int Octree::enumerateChildren(int layer, int px, int py, int pz) {
+	void Octree::collectEnumerationTasks(int layer, int px, int py, int pz, int grain, int& offset, std::vector<EnumerationTask>& tasks) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		int index = px + nx * (py + ny * pz);
+		int cubes = m_counts[layer][index].cubes;
+		if (cubes == 0)
+			// Empty subtree, nothing to enumerate
+			return;
+		if (cubes <= grain || m_data[layer][index].type != NODE) {
+			EnumerationTask task = { layer, px, py, pz, offset };
+			tasks.push_back(task);
+			offset += cubes;
+			return;
+		}
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++)
+					collectEnumerationTasks(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, grain, offset, tasks);
+	}
+
+
+	int Octree::enumerateChildren(int layer, int px, int py, int pz, int*& cubes) const {
 		int count = 0;
 		int nx = (int)m_gridX[layer].size();
 		int ny = (int)m_gridY[layer].size();
-		OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
 		if (element.type == LEAF_IN) {
-			// Compute voxel position of this cube, TODO: use pre-computed arrays
-			int vx = 0, vy = 0, vz = 0; int i;
-			for (i = 0; i < px; i++)
-				vx += m_gridX[layer][i];
-			for (i = 0; i < py; i++)
-				vy += m_gridY[layer][i];
-			for (i = 0; i < pz; i++)
-				vz += m_gridZ[layer][i];
 			// Add this cube
-			m_cubesInside.push_back(vx);
-			m_cubesInside.push_back(vy);
-			m_cubesInside.push_back(vz);
-			m_cubesInside.push_back(m_gridX[layer][px]);
-			m_cubesInside.push_back(m_gridY[layer][py]);
-			m_cubesInside.push_back(m_gridZ[layer][pz]);
+			*cubes++ = m_offsetX[layer][px];
+			*cubes++ = m_offsetY[layer][py];
+			*cubes++ = m_offsetZ[layer][pz];
+			*cubes++ = m_gridX[layer][px];
+			*cubes++ = m_gridY[layer][py];
+			*cubes++ = m_gridZ[layer][pz];
 			count++;
 		}
 		else if (element.type == NODE) {
@@ -288,9 +1580,1061 @@ namespace Fusion
 			for (int zz = 0; zz < nzz; zz++)
 				for (int yy = 0; yy < nyy; yy++)
 					for (int xx = 0; xx < nxx; xx++)
-						count += enumerateChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz);
+						count += enumerateChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, cubes);
 		}
 		return count;
 	}
 
+
+	const std::vector<Octree::CubeAttributes>& Octree::enumerateAttributes() {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		std::vector<uint32_t> layerIds(m_numLayers, 0);
+		for (int layer = 1; layer < m_numLayers; layer++)
+			layerIds[layer] = layerIds[layer - 1] + (uint32_t)(m_gridX[layer - 1].size() * m_gridY[layer - 1].size() * m_gridZ[layer - 1].size());
+		// Same parallel split as enumerate()
+		int num = getNumCubesInside();
+		m_cubeAttributes.resize(num);
+		if (num > 0) {
+			int grain = std::max(1, num / (8 * std::max(1, (int)std::thread::hardware_concurrency())));
+			int offset = 0;
+			std::vector<EnumerationTask> tasks;
+			collectEnumerationTasks(0, 0, 0, 0, grain, offset, tasks);
+			parallelFor(0, (int)tasks.size(), [&](int i) {
+				const EnumerationTask& task = tasks[i];
+				CubeAttributes* cubes = &m_cubeAttributes[task.offset];
+				enumerateAttributeChildren(task.layer, task.px, task.py, task.pz, layerIds, cubes);
+			});
+		}
+		LOG_DEBUG("Octree has " << num << " cubes with attributes, " << t.passed() << " ms");
+		return m_cubeAttributes;
+	}
+
+
+	void Octree::enumerateAttributeChildren(int layer, int px, int py, int pz, const std::vector<uint32_t>& layerIds, CubeAttributes*& cubes) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		int index = px + nx * (py + ny * pz);
+		const OctreeElement& element = m_data[layer][index];
+		if (element.type == LEAF_IN) {
+			CubeAttributes& cube = *cubes++;
+			cube.x = m_offsetX[layer][px];
+			cube.y = m_offsetY[layer][py];
+			cube.z = m_offsetZ[layer][pz];
+			cube.sx = m_gridX[layer][px];
+			cube.sy = m_gridY[layer][py];
+			cube.sz = m_gridZ[layer][pz];
+			cube.min = element.min;
+			cube.max = element.max;
+			cube.id = layerIds[layer] + (uint32_t)index;
+		}
+		else if (element.type == NODE) {
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						enumerateAttributeChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, layerIds, cubes);
+		}
+	}
+
+
+	const std::vector<int>& Octree::classifyAndEnumerate(int min, int max) {
+		OctreeMemoryManager::Use use(this);
+		if ((m_min == min) && (m_max == max))
+			return enumerate();
+		m_min = min; m_max = max;
+		m_classified = true;
+		Timer t;
+		RangePredicate predicate = { m_min, m_max };
+
+		// Split at the first layer with enough elements to keep all threads busy
+		int threads = std::max(1, (int)std::thread::hardware_concurrency());
+		int split = 0;
+		while (split < m_numLayers - 1 && m_gridX[split].size() * m_gridY[split].size() * m_gridZ[split].size() < 8 * (size_t)threads)
+			split++;
+		std::vector<FusedTask> tasks;
+		collectFusedTasks(predicate, 0, 0, 0, 0, split, tasks);
+		parallelFor(0, (int)tasks.size(), [&](int i) {
+			FusedTask& task = tasks[i];
+			size_t next = 0;
+			fuseChildren(predicate, task.layer, task.px, task.py, task.pz, task.cubes, task.voxels, 0, split, next);
+		});
+
+		// Classify the layers above the split, joining the task cubes in enumeration order
+		m_cubesInside.clear();
+		int64_t voxels = 0;
+		size_t next = 0;
+		fuseChildren(predicate, 0, 0, 0, 0, m_cubesInside, voxels, &tasks, split, next);
+		m_voxelsInside = (int)voxels;
+		LOG_DEBUG("Octree range [" << m_min << ".." << m_max << "], " << m_cubesInside.size() / 6 << " cubes from " << tasks.size()
+			<< " tasks, " << t.passed() << " ms");
+		return m_cubesInside;
+	}
+
+
+	void Octree::collectFusedTasks(const RangePredicate& predicate, int layer, int px, int py, int pz, int split, std::vector<FusedTask>& tasks) const {
+		if (layer == split) {
+			FusedTask task;
+			task.layer = layer; task.px = px; task.py = py; task.pz = pz;
+			task.voxels = 0;
+			tasks.push_back(task);
+			return;
+		}
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		if (predicate(element.min, element.max) != NODE)
+			return;
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++)
+					collectFusedTasks(predicate, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, split, tasks);
+	}
+
+
+	Octree::ElementType Octree::fuseChildren(const RangePredicate& predicate, int layer, int px, int py, int pz, std::vector<int>& cubes, int64_t& voxels,
+		std::vector<FusedTask>* tasks, int split, size_t& next) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		if (tasks && layer == split) {
+			// Classified in parallel before
+			FusedTask& task = (*tasks)[next++];
+			cubes.insert(cubes.end(), task.cubes.begin(), task.cubes.end());
+			voxels += task.voxels;
+			return element.type;
+		}
+		ElementType type = predicate(element.min, element.max);
+		if (type == LEAF_OUT)
+			element.type = LEAF_OUT;
+		else if (type == LEAF_IN || layer == m_numLayers - 1) {
+			element.type = LEAF_IN;
+			appendBox(layer, px, py, pz, cubes);
+			voxels += (int64_t)m_gridX[layer][px] * m_gridY[layer][py] * m_gridZ[layer][pz];
+		}
+		else {
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			bool allIn = true, allOut = true;
+			size_t begin = cubes.size();
+			for (int zz = 0; zz < nzz; zz++) {
+				for (int yy = 0; yy < nyy; yy++) {
+					for (int xx = 0; xx < nxx; xx++) {
+						ElementType value = fuseChildren(predicate, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, cubes, voxels, tasks, split, next);
+						if (value == LEAF_IN)		allOut = false;
+						else if (value == LEAF_OUT) allIn = false;
+						else { allIn = false; allOut = false; }
+					}
+				}
+			}
+			if (allIn) {
+				// The cubes of the children merge into this one
+				cubes.resize(begin);
+				appendBox(layer, px, py, pz, cubes);
+				element.type = LEAF_IN;
+			}
+			else if (allOut) element.type = LEAF_OUT;
+			else			 element.type = NODE;
+		}
+		updateInsideCount(layer, px, py, pz);
+		return element.type;
+	}
+
+
+	const std::vector<int>& Octree::enumerateSpans() {
+		OctreeMemoryManager::Use use(this);
+		Timer timer;
+		int leaf = m_numLayers - 1;
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+
+		// Every slab of leaf cells in z is handled independently and appended in order afterwards
+		std::vector<std::vector<int> > slabs(nz);
+		parallelFor(0, nz, [&](int z) {
+			// All voxel rows of a leaf row share the same spans
+			std::vector<std::vector<int> > rows(ny);
+			for (int y = 0; y < ny; y++)
+				spanChildren(0, 0, 0, 0, m_offsetY[leaf][y], m_offsetZ[leaf][z], rows[y]);
+			std::vector<int>& slab = slabs[z];
+			for (int vz = m_offsetZ[leaf][z]; vz < m_offsetZ[leaf][z] + m_gridZ[leaf][z]; vz++) {
+				for (int y = 0; y < ny; y++) {
+					const std::vector<int>& intervals = rows[y];
+					for (int vy = m_offsetY[leaf][y]; vy < m_offsetY[leaf][y] + m_gridY[leaf][y]; vy++) {
+						for (int i = 0; i < (int)intervals.size(); i += 2) {
+							slab.push_back(vy);
+							slab.push_back(vz);
+							slab.push_back(intervals[i]);
+							slab.push_back(intervals[i + 1]);
+						}
+					}
+				}
+			}
+		});
+		m_spansInside.clear();
+		for (const auto& slab : slabs)
+			m_spansInside.insert(m_spansInside.end(), slab.begin(), slab.end());
+		LOG_DEBUG("Octree has " << m_spansInside.size() / 4 << " spans, " << timer.passed() << " ms");
+		return m_spansInside;
+	}
+
+
+	void Octree::spanChildren(int layer, int px, int py, int pz, int vy, int vz, std::vector<int>& intervals) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		if (element.type == LEAF_IN) {
+			int x0 = m_offsetX[layer][px];
+			int x1 = x0 + m_gridX[layer][px];
+			// Merge with the previous interval if adjacent, also across subtree boundaries
+			if (!intervals.empty() && intervals.back() == x0)
+				intervals.back() = x1;
+			else {
+				intervals.push_back(x0);
+				intervals.push_back(x1);
+			}
+		}
+		else if (element.type == NODE) {
+			// Only descend into the children containing the voxel row
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			int cy = nyy * py, cz = nzz * pz;
+			if (nyy > 1 && vy >= m_offsetY[layer + 1][cy + 1]) cy++;
+			if (nzz > 1 && vz >= m_offsetZ[layer + 1][cz + 1]) cz++;
+			for (int xx = 0; xx < nxx; xx++)
+				spanChildren(layer + 1, nxx * px + xx, cy, cz, vy, vz, intervals);
+		}
+	}
+
+
+
+	std::vector<uint64_t> Octree::exportMortonIntervals() const {
+		OctreeMemoryManager::Use use(this);
+		std::vector<uint64_t> intervals = collectMortonIntervals();
+		LOG_DEBUG("Octree exported " << intervals.size() / 2 << " Morton intervals");
+		return intervals;
+	}
+
+
+	std::vector<uint64_t> Octree::collectMortonIntervals() const {
+		std::vector<uint64_t> ranges;
+		mortonChildren(0, 0, 0, 0, ranges);
+
+		// Sort the intervals by begin and merge adjacent ones
+		std::vector<std::pair<uint64_t, uint64_t> > sorted;
+		for (size_t i = 0; i < ranges.size(); i += 2)
+			sorted.push_back(std::make_pair(ranges[i], ranges[i + 1]));
+		std::sort(sorted.begin(), sorted.end());
+		std::vector<uint64_t> intervals;
+		for (const auto& range : sorted) {
+			if (!intervals.empty() && intervals.back() == range.first)
+				intervals.back() = range.second;
+			else {
+				intervals.push_back(range.first);
+				intervals.push_back(range.second);
+			}
+		}
+		return intervals;
+	}
+
+
+	void Octree::importMortonIntervals(const std::vector<uint64_t>& intervals) {
+		OctreeMemoryManager::Use use(this);
+		// The classification no longer corresponds to any range, force the next setInsideRange to update
+		m_min = std::numeric_limits<int>::max();
+		m_max = std::numeric_limits<int>::min();
+		m_classified = true;
+		m_voxelsInside = 0;
+		Timer timer;
+		importChildren(0, 0, 0, 0, intervals);
+		LOG_DEBUG("Octree imported " << intervals.size() / 2 << " Morton intervals, " << m_voxelsInside << " voxels inside, " << timer.passed() << " ms");
+	}
+
+
+	void Octree::getMortonRanges(int layer, int px, int py, int pz, std::vector<uint64_t>& ranges) const {
+		// Number of leaf cells per dimension below this element, always a power of two
+		int leaf = m_numLayers - 1;
+		int rx = (int)(m_gridX[leaf].size() / m_gridX[layer].size());
+		int ry = (int)(m_gridY[leaf].size() / m_gridY[layer].size());
+		int rz = (int)(m_gridZ[leaf].size() / m_gridZ[layer].size());
+		// Aligned cubes of the smallest extent are contiguous in Morton order
+		int r = std::min(std::min(rx, ry), rz);
+		uint64_t length = (uint64_t)r * r * r;
+		for (int z = pz * rz; z < (pz + 1) * rz; z += r)
+			for (int y = py * ry; y < (py + 1) * ry; y += r)
+				for (int x = px * rx; x < (px + 1) * rx; x += r) {
+					uint64_t code = mortonCode(x, y, z);
+					ranges.push_back(code);
+					ranges.push_back(code + length);
+				}
+	}
+
+
+	void Octree::mortonChildren(int layer, int px, int py, int pz, std::vector<uint64_t>& ranges) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		if (element.type == LEAF_IN)
+			getMortonRanges(layer, px, py, pz, ranges);
+		else if (element.type == NODE) {
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						mortonChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, ranges);
+		}
+	}
+
+
+	Octree::ElementType Octree::importChildren(int layer, int px, int py, int pz, const std::vector<uint64_t>& intervals) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+
+		// Determine coverage of the element by binary search in the interval ends
+		std::vector<uint64_t> ranges;
+		getMortonRanges(layer, px, py, pz, ranges);
+		bool allIn = true, allOut = true;
+		for (size_t i = 0; i < ranges.size(); i += 2) {
+			// First interval ending after the start of the range, interval ends are at odd positions
+			size_t lo = 0, hi = intervals.size() / 2;
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+				if (intervals[2 * mid + 1] <= ranges[i]) lo = mid + 1;
+				else hi = mid;
+			}
+			if (lo == intervals.size() / 2 || intervals[2 * lo] >= ranges[i + 1])
+				allIn = false;
+			else if (intervals[2 * lo] <= ranges[i] && intervals[2 * lo + 1] >= ranges[i + 1])
+				allOut = false;
+			else { allIn = false; allOut = false; }
+		}
+
+		if (allOut)
+			element.type = LEAF_OUT;
+		else if (allIn) {
+			element.type = LEAF_IN;
+			setChildrenType(layer, px, py, pz, LEAF_IN);
+			m_voxelsInside += m_gridX[layer][px] * m_gridY[layer][py] * m_gridZ[layer][pz];
+		}
+		else {
+			// Partially covered, need to check children
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						importChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, intervals);
+			element.type = NODE;
+		}
+		updateInsideCount(layer, px, py, pz);
+		return element.type;
+	}
+
+
+
+	bool Octree::intersectsInside(int x0, int y0, int z0, int x1, int y1, int z1) const {
+		OctreeMemoryManager::Use use(this);
+		return intersectsChildren(0, 0, 0, 0, x0, y0, z0, x1, y1, z1);
+	}
+
+
+	bool Octree::intersectsChildren(int layer, int px, int py, int pz, int x0, int y0, int z0, int x1, int y1, int z1) const {
+		// Prune elements not overlapping the box
+		if (m_offsetX[layer][px] >= x1 || m_offsetX[layer][px] + m_gridX[layer][px] <= x0 ||
+			m_offsetY[layer][py] >= y1 || m_offsetY[layer][py] + m_gridY[layer][py] <= y0 ||
+			m_offsetZ[layer][pz] >= z1 || m_offsetZ[layer][pz] + m_gridZ[layer][pz] <= z0)
+			return false;
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		ElementType type = m_data[layer][px + nx * (py + ny * pz)].type;
+		if (type != NODE)
+			return type == LEAF_IN;
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++)
+					if (intersectsChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, x0, y0, z0, x1, y1, z1))
+						return true;
+		return false;
+	}
+
+
+	template<typename T> void Octree::resample(TypedImage<T>* source, TypedImage<T>* output, const double transform[12], T outsideValue, int blockSize) const {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		int width = output->width(), height = output->height(), slices = output->slices();
+		int bx = (width + blockSize - 1) / blockSize;
+		int by = (height + blockSize - 1) / blockSize;
+		int bz = (slices + blockSize - 1) / blockSize;
+		const T* srcPtr = source->pointer();
+		T* outPtr = output->pointer();
+		std::atomic<int> numSkipped(0);
+
+		parallelFor(0, bx * by * bz, [&](int block) {
+			int x0 = blockSize * (block % bx), y0 = blockSize * ((block / bx) % by), z0 = blockSize * (block / (bx * by));
+			int x1 = std::min(x0 + blockSize, width), y1 = std::min(y0 + blockSize, height), z1 = std::min(z0 + blockSize, slices);
+
+			// Source footprint of the block from its transformed corners, the transform being affine
+			double lo[3] = { std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max() };
+			double hi[3] = { -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), -std::numeric_limits<double>::max() };
+			for (int corner = 0; corner < 8; corner++) {
+				double x = (corner & 1) ? x1 - 1 : x0, y = (corner & 2) ? y1 - 1 : y0, z = (corner & 4) ? z1 - 1 : z0;
+				for (int i = 0; i < 3; i++) {
+					double p = transform[4 * i] * x + transform[4 * i + 1] * y + transform[4 * i + 2] * z + transform[4 * i + 3];
+					lo[i] = std::min(lo[i], p);
+					hi[i] = std::max(hi[i], p);
+				}
+			}
+			// Interpolation reaches up to the next voxel
+			bool visible = intersectsChildren(0, 0, 0, 0, (int)std::floor(lo[0]), (int)std::floor(lo[1]), (int)std::floor(lo[2]),
+				(int)std::floor(hi[0]) + 2, (int)std::floor(hi[1]) + 2, (int)std::floor(hi[2]) + 2);
+
+			for (int z = z0; z < z1; z++) {
+				for (int y = y0; y < y1; y++) {
+					T* row = outPtr + (size_t)width * (y + (size_t)height * z);
+					if (!visible) {
+						std::fill(row + x0, row + x1, outsideValue);
+						continue;
+					}
+					for (int x = x0; x < x1; x++) {
+						double sx = transform[0] * x + transform[1] * y + transform[2] * z + transform[3];
+						double sy = transform[4] * x + transform[5] * y + transform[6] * z + transform[7];
+						double sz = transform[8] * x + transform[9] * y + transform[10] * z + transform[11];
+						row[x] = sampleTrilinear(srcPtr, source->width(), source->height(), source->slices(), sx, sy, sz, outsideValue);
+					}
+				}
+			}
+			if (!visible)
+				numSkipped++;
+		});
+		LOG_DEBUG("Octree resampling skipped " << numSkipped << " of " << bx * by * bz << " blocks, " << t.passed() << " ms");
+	}
+
+	template void Octree::resample<unsigned char>(TypedImage<unsigned char>*, TypedImage<unsigned char>*, const double[12], unsigned char, int) const;
+	template void Octree::resample<unsigned short>(TypedImage<unsigned short>*, TypedImage<unsigned short>*, const double[12], unsigned short, int) const;
+
+
+
+	std::vector<int> Octree::samplePositions(int numSamples, bool stratified, unsigned int seed) const {
+		OctreeMemoryManager::Use use(this);
+		std::vector<int> positions;
+		int64_t numVoxels = getNumVoxelsInside();
+		if (numVoxels == 0 || numSamples <= 0)
+			return positions;
+
+		// Ranks of the sampled voxels among all inside voxels, in traversal order
+		Timer t;
+		std::mt19937_64 random(seed);
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		std::vector<int64_t> ranks(numSamples);
+		for (int i = 0; i < numSamples; i++) {
+			double u = stratified ? (i + uniform(random)) / numSamples : uniform(random);
+			ranks[i] = std::min((int64_t)(u * numVoxels), numVoxels - 1);
+		}
+		if (!stratified)
+			std::sort(ranks.begin(), ranks.end());
+
+		positions.reserve(3 * numSamples);
+		size_t next = 0;
+		sampleChildren(0, 0, 0, 0, 0, ranks, next, positions);
+
+		// Sort into memory order for cache-friendly access
+		int width = m_gridX[0][0], height = m_gridY[0][0];
+		std::vector<int64_t> keys(numSamples);
+		for (int i = 0; i < numSamples; i++)
+			keys[i] = positions[3 * i] + width * (positions[3 * i + 1] + (int64_t)height * positions[3 * i + 2]);
+		std::sort(keys.begin(), keys.end());
+		for (int i = 0; i < numSamples; i++) {
+			positions[3 * i] = (int)(keys[i] % width);
+			positions[3 * i + 1] = (int)(keys[i] / width % height);
+			positions[3 * i + 2] = (int)(keys[i] / width / height);
+		}
+		LOG_DEBUG("Octree drew " << numSamples << " samples in " << t.passed() << " ms");
+		return positions;
+	}
+
+
+	void Octree::sampleChildren(int layer, int px, int py, int pz, int64_t base, const std::vector<int64_t>& ranks, size_t& next, std::vector<int>& positions) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		if (element.type == LEAF_IN) {
+			// Locate the ranks within the cube, x running fastest
+			int sx = m_gridX[layer][px], sy = m_gridY[layer][py];
+			int64_t end = base + (int64_t)sx * sy * m_gridZ[layer][pz];
+			for (; next < ranks.size() && ranks[next] < end; next++) {
+				int64_t local = ranks[next] - base;
+				positions.push_back(m_offsetX[layer][px] + (int)(local % sx));
+				positions.push_back(m_offsetY[layer][py] + (int)(local / sx % sy));
+				positions.push_back(m_offsetZ[layer][pz] + (int)(local / sx / sy));
+			}
+		}
+		else if (element.type == NODE) {
+			// Skip children whose voxels contain no sampled rank
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz && next < ranks.size(); zz++) {
+				for (int yy = 0; yy < nyy; yy++) {
+					for (int xx = 0; xx < nxx; xx++) {
+						int cx = nxx * px + xx, cy = nyy * py + yy, cz = nzz * pz + zz;
+						int64_t voxels = m_counts[layer + 1][cx + nx * nxx * (cy + ny * nyy * cz)].voxels;
+						if (next < ranks.size() && ranks[next] < base + voxels)
+							sampleChildren(layer + 1, cx, cy, cz, base, ranks, next, positions);
+						base += voxels;
+					}
+				}
+			}
+		}
+	}
+
+
+
+	std::vector<Octree::FilteredBlock> Octree::getActiveBlocks(int apron, int blockSize) const {
+		int width = m_gridX[0][0], height = m_gridY[0][0], slices = m_gridZ[0][0];
+		std::vector<FilteredBlock> blocks;
+		for (int z = 0; z < slices; z += blockSize) {
+			for (int y = 0; y < height; y += blockSize) {
+				for (int x = 0; x < width; x += blockSize) {
+					FilteredBlock block;
+					block.x = x; block.y = y; block.z = z;
+					block.sx = std::min(blockSize, width - x);
+					block.sy = std::min(blockSize, height - y);
+					block.sz = std::min(blockSize, slices - z);
+					if (intersectsChildren(0, 0, 0, 0, x - apron, y - apron, z - apron, x + block.sx + apron, y + block.sy + apron, z + block.sz + apron))
+						blocks.push_back(block);
+				}
+			}
+		}
+		return blocks;
+	}
+
+
+	template<typename T> std::vector<Octree::FilteredBlock> Octree::filterBlocks(TypedImage<T>* source, const std::vector<float>& kernelX,
+		const std::vector<float>& kernelY, const std::vector<float>& kernelZ, int apron, int blockSize) const {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		std::vector<FilteredBlock> blocks = getActiveBlocks(apron, blockSize);
+		parallelFor(0, (int)blocks.size(), [&](int i) {
+			FilteredBlock& block = blocks[i];
+			block.values.resize((size_t)block.sx * block.sy * block.sz);
+			convolveBlock(source, kernelX, kernelY, kernelZ, block.x, block.y, block.z,
+				block.x + block.sx, block.y + block.sy, block.z + block.sz, &block.values[0]);
+		});
+		LOG_DEBUG("Octree filtered " << blocks.size() << " blocks in " << t.passed() << " ms");
+		return blocks;
+	}
+
+
+	template<typename T> void Octree::filter(TypedImage<T>* source, TypedImage<float>* output, const std::vector<float>& kernelX,
+		const std::vector<float>& kernelY, const std::vector<float>& kernelZ, int apron, int blockSize) const {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		std::vector<FilteredBlock> blocks = getActiveBlocks(apron, blockSize);
+		int width = output->width(), height = output->height();
+		float* outPtr = output->pointer();
+		parallelFor(0, (int)blocks.size(), [&](int i) {
+			const FilteredBlock& block = blocks[i];
+			std::vector<float> values((size_t)block.sx * block.sy * block.sz);
+			convolveBlock(source, kernelX, kernelY, kernelZ, block.x, block.y, block.z,
+				block.x + block.sx, block.y + block.sy, block.z + block.sz, &values[0]);
+			// Blocks are disjoint, copy the rows into the output
+			for (int z = 0; z < block.sz; z++)
+				for (int y = 0; y < block.sy; y++)
+					std::copy(values.begin() + (size_t)block.sx * (y + block.sy * z), values.begin() + (size_t)block.sx * (y + 1 + block.sy * z),
+						outPtr + block.x + (size_t)width * (block.y + y + (size_t)height * (block.z + z)));
+		});
+		LOG_DEBUG("Octree filtered " << blocks.size() << " blocks in " << t.passed() << " ms");
+	}
+
+	template void Octree::filter<unsigned char>(TypedImage<unsigned char>*, TypedImage<float>*, const std::vector<float>&, const std::vector<float>&, const std::vector<float>&, int, int) const;
+	template void Octree::filter<unsigned short>(TypedImage<unsigned short>*, TypedImage<float>*, const std::vector<float>&, const std::vector<float>&, const std::vector<float>&, int, int) const;
+	template std::vector<Octree::FilteredBlock> Octree::filterBlocks<unsigned char>(TypedImage<unsigned char>*, const std::vector<float>&, const std::vector<float>&, const std::vector<float>&, int, int) const;
+	template std::vector<Octree::FilteredBlock> Octree::filterBlocks<unsigned short>(TypedImage<unsigned short>*, const std::vector<float>&, const std::vector<float>&, const std::vector<float>&, int, int) const;
+
+
+
+	template<typename T> double Octree::surfaceArea(TypedImage<T>* image, int threshold, double spacingX, double spacingY, double spacingZ) const {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+		int width = image->width(), height = image->height(), slices = image->slices();
+		const T* imgPtr = image->pointer();
+		// Area of a voxel face with its normal along x, y and z
+		const double faceArea[3] = { spacingY * spacingZ, spacingX * spacingZ, spacingX * spacingY };
+		const int dx[6] = { -1, 1, 0, 0, 0, 0 }, dy[6] = { 0, 0, -1, 1, 0, 0 }, dz[6] = { 0, 0, 0, 0, -1, 1 };
+		auto inside = [&](int x, int y, int z) {
+			return x >= 0 && y >= 0 && z >= 0 && x < width && y < height && z < slices &&
+				(int)imgPtr[x + (size_t)width * (y + (size_t)height * z)] >= threshold;
+		};
+
+		std::vector<double> slabArea(nz, 0.0);
+		parallelFor(0, nz, [&](int z) {
+			double area = 0;
+			for (int y = 0; y < ny; y++) {
+				for (int x = 0; x < nx; x++) {
+					const OctreeElement& element = m_data[leaf][x + nx * (y + ny * z)];
+					if (element.max < threshold)
+						continue;
+					int x0 = m_offsetX[leaf][x], x1 = x0 + m_gridX[leaf][x];
+					int y0 = m_offsetY[leaf][y], y1 = y0 + m_gridY[leaf][y];
+					int z0 = m_offsetZ[leaf][z], z1 = z0 + m_gridZ[leaf][z];
+					if (element.min < threshold) {
+						// Straddling cell, check all faces of all inside voxels
+						for (int vz = z0; vz < z1; vz++)
+							for (int vy = y0; vy < y1; vy++)
+								for (int vx = x0; vx < x1; vx++)
+									if (inside(vx, vy, vz))
+										for (int face = 0; face < 6; face++)
+											if (!inside(vx + dx[face], vy + dy[face], vz + dz[face]))
+												area += faceArea[face / 2];
+						continue;
+					}
+					// Entirely inside, only the cell faces can border outside voxels
+					for (int face = 0; face < 6; face++) {
+						int cx = x + dx[face], cy = y + dy[face], cz = z + dz[face];
+						if (cx >= 0 && cy >= 0 && cz >= 0 && cx < nx && cy < ny && cz < nz &&
+							m_data[leaf][cx + nx * (cy + ny * cz)].min >= threshold)
+							continue;
+						// Voxels of the cell on this face
+						int fx0 = dx[face] > 0 ? x1 - 1 : x0, fx1 = dx[face] < 0 ? x0 + 1 : x1;
+						int fy0 = dy[face] > 0 ? y1 - 1 : y0, fy1 = dy[face] < 0 ? y0 + 1 : y1;
+						int fz0 = dz[face] > 0 ? z1 - 1 : z0, fz1 = dz[face] < 0 ? z0 + 1 : z1;
+						for (int vz = fz0; vz < fz1; vz++)
+							for (int vy = fy0; vy < fy1; vy++)
+								for (int vx = fx0; vx < fx1; vx++)
+									if (!inside(vx + dx[face], vy + dy[face], vz + dz[face]))
+										area += faceArea[face / 2];
+					}
+				}
+			}
+			slabArea[z] = area;
+		});
+		double area = 0;
+		for (double slab : slabArea)
+			area += slab;
+		LOG_DEBUG("Octree surface area at " << threshold << " is " << area << ", " << t.passed() << " ms");
+		return area;
+	}
+
+	template double Octree::surfaceArea<unsigned char>(TypedImage<unsigned char>*, int, double, double, double) const;
+	template double Octree::surfaceArea<unsigned short>(TypedImage<unsigned short>*, int, double, double, double) const;
+
+
+
+	bool Octree::getInsideBounds(int box[6]) const {
+		return getInsideBounds<unsigned char>(0, box);
+	}
+
+
+	template<typename T> bool Octree::getInsideBounds(TypedImage<T>* image, int box[6]) const {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		for (int axis = 0; axis < 3; axis++) {
+			box[axis] = std::numeric_limits<int>::max();
+			box[axis + 3] = std::numeric_limits<int>::min();
+			searchBounds<T>(image, axis, false, 0, 0, 0, 0, false, box[axis]);
+			if (box[axis] == std::numeric_limits<int>::max())
+				return false;
+			searchBounds<T>(image, axis, true, 0, 0, 0, 0, false, box[axis + 3]);
+		}
+		LOG_DEBUG("Octree inside bounds [" << box[0] << ".." << box[3] << "] x [" << box[1] << ".." << box[4] << "] x ["
+			<< box[2] << ".." << box[5] << "], " << t.passed() << " ms");
+		return true;
+	}
+
+
+	template<typename T> void Octree::searchBounds(const TypedImage<T>* image, int axis, bool maximum, int layer, int px, int py, int pz, bool inside, int& best) const {
+		const std::vector<std::vector<int> >* offsets[3] = { &m_offsetX, &m_offsetY, &m_offsetZ };
+		const std::vector<std::vector<int> >* grids[3] = { &m_gridX, &m_gridY, &m_gridZ };
+		int p[3] = { px, py, pz };
+		int start = (*offsets[axis])[layer][p[axis]];
+		int end = start + (*grids[axis])[layer][p[axis]];
+		// Prune elements which cannot improve the extreme
+		if (maximum ? end <= best : start >= best)
+			return;
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		// Types below an inside element are not maintained, everything there is inside
+		if (!inside) {
+			if (element.type == LEAF_OUT)
+				return;
+			inside = element.type == LEAF_IN;
+		}
+		if (inside && (!image || (element.min >= m_min && element.max <= m_max))) {
+			// All voxels of this element count
+			best = maximum ? end : start;
+			return;
+		}
+		if (image && (element.max < m_min || element.min > m_max))
+			return;
+		int other1 = (axis + 1) % 3, other2 = (axis + 2) % 3;
+		if (layer == m_numLayers - 1) {
+			// A leaf still of type NODE was never classified, without an image there is nothing to find
+			if (!image)
+				return;
+			// Boundary leaf, scan the planes which can still improve the extreme, nearest first, up to the first voxel in range
+			int lo[3] = { m_offsetX[layer][px], m_offsetY[layer][py], m_offsetZ[layer][pz] };
+			int hi[3] = { lo[0] + m_gridX[layer][px], lo[1] + m_gridY[layer][py], lo[2] + m_gridZ[layer][pz] };
+			if (maximum)
+				lo[axis] = std::max(lo[axis], best);
+			else
+				hi[axis] = std::min(hi[axis], best);
+			const T* imgPtr = image->pointer();
+			int v[3];
+			for (int i = 0; i < hi[axis] - lo[axis]; i++) {
+				v[axis] = maximum ? hi[axis] - 1 - i : lo[axis] + i;
+				for (v[other2] = lo[other2]; v[other2] < hi[other2]; v[other2]++)
+					for (v[other1] = lo[other1]; v[other1] < hi[other1]; v[other1]++) {
+						int value = (int)imgPtr[v[0] + (size_t)image->width() * (v[1] + (size_t)image->height() * v[2])];
+						if (value >= m_min && value <= m_max) {
+							best = maximum ? v[axis] + 1 : v[axis];
+							return;
+						}
+					}
+			}
+			return;
+		}
+		// Visit children in order along the axis, so the first ones found prune the rest
+		int split[3]; getSplit(layer, split[0], split[1], split[2]);
+		int c[3];
+		for (int i = 0; i < split[axis]; i++) {
+			c[axis] = maximum ? split[axis] - 1 - i : i;
+			for (c[other2] = 0; c[other2] < split[other2]; c[other2]++)
+				for (c[other1] = 0; c[other1] < split[other1]; c[other1]++)
+					searchBounds<T>(image, axis, maximum, layer + 1, split[0] * px + c[0], split[1] * py + c[1], split[2] * pz + c[2], inside, best);
+		}
+	}
+
+	template bool Octree::getInsideBounds<unsigned char>(TypedImage<unsigned char>*, int[6]) const;
+	template bool Octree::getInsideBounds<unsigned short>(TypedImage<unsigned short>*, int[6]) const;
+
+
+
+	bool Octree::intersectsInside(const ProbeShape& shape) const {
+		return intersectsInside<unsigned char>(0, shape);
+	}
+
+
+	template<typename T> bool Octree::intersectsInside(TypedImage<T>* image, const ProbeShape& shape) const {
+		OctreeMemoryManager::Use use(this);
+		// Anything farther than the radius is pruned right away
+		double best = std::nextafter(shape.radius, std::numeric_limits<double>::infinity());
+		probeChildren<T>(image, shape, 0, 0, 0, 0, false, shape.radius, best);
+		return best <= shape.radius;
+	}
+
+
+	double Octree::getPenetration(const ProbeShape& shape) const {
+		return getPenetration<unsigned char>(0, shape);
+	}
+
+
+	template<typename T> double Octree::getPenetration(TypedImage<T>* image, const ProbeShape& shape) const {
+		OctreeMemoryManager::Use use(this);
+		// Stop as soon as the core touches the inside region, which caps the depth at the radius
+		double best = std::numeric_limits<double>::infinity();
+		probeChildren<T>(image, shape, 0, 0, 0, 0, false, 0.0, best);
+		return shape.radius - best;
+	}
+
+
+	template<typename T> void Octree::probeChildren(const TypedImage<T>* image, const ProbeShape& shape, int layer, int px, int py, int pz, bool inside, double stopDistance, double& best) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		// Types below an inside element are not maintained, everything there is inside
+		if (!inside) {
+			if (element.type == LEAF_OUT)
+				return;
+			inside = element.type == LEAF_IN;
+		}
+		double lo[3] = { (double)m_offsetX[layer][px], (double)m_offsetY[layer][py], (double)m_offsetZ[layer][pz] };
+		double hi[3] = { lo[0] + m_gridX[layer][px], lo[1] + m_gridY[layer][py], lo[2] + m_gridZ[layer][pz] };
+		if (inside && (!image || (element.min >= m_min && element.max <= m_max))) {
+			// All voxels of this cell count
+			best = std::min(best, coreDistance(shape, lo, hi));
+			return;
+		}
+		if (image && (element.max < m_min || element.min > m_max))
+			return;
+		if (layer == m_numLayers - 1) {
+			// A leaf still of type NODE was never classified, without an image there is nothing to find
+			if (!image)
+				return;
+			// Boundary leaf, test the voxels in range that can still improve the distance
+			double coreLo[3], coreHi[3];
+			for (int i = 0; i < 3; i++) {
+				coreLo[i] = shape.kind == ProbeShape::SPHERE ? shape.a[i] : std::min(shape.a[i], shape.b[i]);
+				coreHi[i] = shape.kind == ProbeShape::SPHERE ? shape.a[i] : std::max(shape.a[i], shape.b[i]);
+			}
+			int v0[3], v1[3];
+			for (int i = 0; i < 3; i++) {
+				v0[i] = (int)std::max(lo[i], std::floor(coreLo[i] - best));
+				v1[i] = (int)std::min(hi[i], std::floor(coreHi[i] + best) + 1);
+			}
+			const T* imgPtr = image->pointer();
+			for (int z = v0[2]; z < v1[2]; z++)
+				for (int y = v0[1]; y < v1[1]; y++)
+					for (int x = v0[0]; x < v1[0]; x++) {
+						int value = (int)imgPtr[x + (size_t)image->width() * (y + (size_t)image->height() * z)];
+						if (value < m_min || value > m_max)
+							continue;
+						double voxelLo[3] = { (double)x, (double)y, (double)z };
+						double voxelHi[3] = { x + 1.0, y + 1.0, z + 1.0 };
+						best = std::min(best, coreDistance(shape, voxelLo, voxelHi));
+						if (best <= stopDistance)
+							return;
+					}
+			return;
+		}
+
+		// Node or inside element over boundary leaves, visit children nearest first, skipping those which cannot improve the distance
+		int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+		int children[8][3];
+		double distances[8];
+		int numChildren = 0;
+		for (int zz = 0; zz < nzz; zz++)
+			for (int yy = 0; yy < nyy; yy++)
+				for (int xx = 0; xx < nxx; xx++) {
+					int cx = nxx * px + xx, cy = nyy * py + yy, cz = nzz * pz + zz;
+					double childLo[3] = { (double)m_offsetX[layer + 1][cx], (double)m_offsetY[layer + 1][cy], (double)m_offsetZ[layer + 1][cz] };
+					double childHi[3] = { childLo[0] + m_gridX[layer + 1][cx], childLo[1] + m_gridY[layer + 1][cy], childLo[2] + m_gridZ[layer + 1][cz] };
+					double distance = coreDistance(shape, childLo, childHi);
+					int i = numChildren++;
+					for (; i > 0 && distances[i - 1] > distance; i--) {
+						distances[i] = distances[i - 1];
+						std::copy(children[i - 1], children[i - 1] + 3, children[i]);
+					}
+					distances[i] = distance;
+					children[i][0] = cx; children[i][1] = cy; children[i][2] = cz;
+				}
+		for (int i = 0; i < numChildren && distances[i] < best; i++) {
+			probeChildren<T>(image, shape, layer + 1, children[i][0], children[i][1], children[i][2], inside, stopDistance, best);
+			if (best <= stopDistance)
+				return;
+		}
+	}
+
+	template bool Octree::intersectsInside<unsigned char>(TypedImage<unsigned char>*, const ProbeShape&) const;
+	template bool Octree::intersectsInside<unsigned short>(TypedImage<unsigned short>*, const ProbeShape&) const;
+	template double Octree::getPenetration<unsigned char>(TypedImage<unsigned char>*, const ProbeShape&) const;
+	template double Octree::getPenetration<unsigned short>(TypedImage<unsigned short>*, const ProbeShape&) const;
+
+
+
+	template<typename T> void Octree::signedDistance(TypedImage<T>* image, TypedImage<float>* output, int band) const {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		std::vector<char> sides, inBand;
+		collectBandCells(band + 0.5, sides, inBand);
+
+		int width = image->width(), height = image->height();
+		float* outPtr = output->pointer();
+		std::atomic<int> numBand(0);
+		parallelFor(0, (int)sides.size(), [&](int i) {
+			int px = i % nx, py = (i / nx) % ny, pz = i / (nx * ny);
+			int box[6] = { m_offsetX[leaf][px], m_offsetY[leaf][py], m_offsetZ[leaf][pz] };
+			box[3] = box[0] + m_gridX[leaf][px]; box[4] = box[1] + m_gridY[leaf][py]; box[5] = box[2] + m_gridZ[leaf][pz];
+			if (!inBand[i]) {
+				// Deep inside or outside
+				float value = sides[i] == SIDE_IN ? -(float)band : (float)band;
+				for (int z = box[2]; z < box[5]; z++)
+					for (int y = box[1]; y < box[4]; y++)
+						std::fill(outPtr + box[0] + (size_t)width * (y + (size_t)height * z), outPtr + box[3] + (size_t)width * (y + (size_t)height * z), value);
+				return;
+			}
+			numBand++;
+			int grown[6];
+			std::vector<float> toInside, toOutside;
+			boxDistances(image, m_min, m_max, box, band + 1, grown, toInside, toOutside);
+			int sx = grown[3] - grown[0], sy = grown[4] - grown[1];
+			for (int z = box[2]; z < box[5]; z++)
+				for (int y = box[1]; y < box[4]; y++)
+					for (int x = box[0]; x < box[3]; x++) {
+						size_t local = (x - grown[0]) + (size_t)sx * ((y - grown[1]) + (size_t)sy * (z - grown[2]));
+						// A voxel is at distance zero from its own side
+						float distance;
+						if (toInside[local] == 0)
+							distance = -std::min(std::sqrt(toOutside[local]) - 0.5f, (float)band);
+						else
+							distance = std::min(std::sqrt(toInside[local]) - 0.5f, (float)band);
+						outPtr[x + (size_t)width * (y + (size_t)height * z)] = distance;
+					}
+		});
+		LOG_DEBUG("Octree signed distance with band " << band << ", " << numBand << " of " << sides.size() << " leaf cells in band, " << t.passed() << " ms");
+	}
+
+
+	void Octree::collectBandCells(double distance, std::vector<char>& sides, std::vector<char>& inBand) const {
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		int nz = (int)m_gridZ[leaf].size();
+		sides.resize((size_t)nx * ny * nz);
+		collectLeafSides(0, 0, 0, 0, false, sides);
+
+		int reach = (int)distance + 1;
+		const std::vector<int>* offsets[3] = { &m_offsetX[leaf], &m_offsetY[leaf], &m_offsetZ[leaf] };
+		const std::vector<int>* sizes[3] = { &m_gridX[leaf], &m_gridY[leaf], &m_gridZ[leaf] };
+		inBand.assign(sides.size(), 0);
+		parallelFor(0, nz, [&](int z) {
+			int p[3]; p[2] = z;
+			for (p[1] = 0; p[1] < ny; p[1]++)
+				for (p[0] = 0; p[0] < nx; p[0]++) {
+					size_t index = p[0] + (size_t)nx * (p[1] + (size_t)ny * p[2]);
+					char side = sides[index];
+					bool found = side == SIDE_MIXED;
+					// Neighbour cells per axis whose voxels come within reach
+					int lo[3], hi[3];
+					for (int a = 0; a < 3; a++) {
+						int begin = (*offsets[a])[p[a]], end = begin + (*sizes[a])[p[a]];
+						for (lo[a] = p[a]; lo[a] > 0 && (*offsets[a])[lo[a] - 1] + (*sizes[a])[lo[a] - 1] > begin - reach; lo[a]--);
+						for (hi[a] = p[a]; hi[a] + 1 < (int)offsets[a]->size() && (*offsets[a])[hi[a] + 1] < end + reach; hi[a]++);
+					}
+					int q[3];
+					for (q[2] = lo[2]; q[2] <= hi[2] && !found; q[2]++)
+						for (q[1] = lo[1]; q[1] <= hi[1] && !found; q[1]++)
+							for (q[0] = lo[0]; q[0] <= hi[0] && !found; q[0]++) {
+								if (sides[q[0] + (size_t)nx * (q[1] + (size_t)ny * q[2])] == side)
+									continue;
+								double gap2 = 0;
+								for (int a = 0; a < 3; a++) {
+									int begin = (*offsets[a])[p[a]], end = begin + (*sizes[a])[p[a]];
+									int otherBegin = (*offsets[a])[q[a]], otherEnd = otherBegin + (*sizes[a])[q[a]];
+									int gap = std::max(0, std::max(otherBegin - end + 1, begin - otherEnd + 1));
+									gap2 += (double)gap * gap;
+								}
+								found = gap2 <= distance * distance;
+							}
+					inBand[index] = found;
+				}
+		});
+	}
+
+
+	void Octree::collectLeafSides(int layer, int px, int py, int pz, bool inside, std::vector<char>& sides) const {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		int leaf = m_numLayers - 1;
+		// Types below an inside element are not maintained, everything there is inside
+		inside = inside || element.type == LEAF_IN;
+		char side;
+		if ((!inside && element.type == LEAF_OUT) || element.max < m_min || element.min > m_max)
+			side = SIDE_OUT;
+		else if (inside && element.min >= m_min && element.max <= m_max)
+			side = SIDE_IN;
+		else if (layer == leaf)
+			side = SIDE_MIXED;
+		else {
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						collectLeafSides(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, inside, sides);
+			return;
+		}
+		// Mark all leaf cells below the element
+		int lnx = (int)m_gridX[leaf].size(), lny = (int)m_gridY[leaf].size();
+		int rx = lnx / nx, ry = lny / ny, rz = (int)m_gridZ[leaf].size() / (int)m_gridZ[layer].size();
+		for (int z = pz * rz; z < (pz + 1) * rz; z++)
+			for (int y = py * ry; y < (py + 1) * ry; y++)
+				std::fill(sides.begin() + px * rx + (size_t)lnx * (y + (size_t)lny * z), sides.begin() + (px + 1) * rx + (size_t)lnx * (y + (size_t)lny * z), side);
+	}
+
+	template void Octree::signedDistance<unsigned char>(TypedImage<unsigned char>*, TypedImage<float>*, int) const;
+	template void Octree::signedDistance<unsigned short>(TypedImage<unsigned short>*, TypedImage<float>*, int) const;
+
+
+
+	template<typename T> void Octree::morphology(TypedImage<T>* image, TypedImage<unsigned char>* mask, int radius) const {
+		OctreeMemoryManager::Use use(this);
+		Timer t;
+		std::vector<char> leafSet;
+		morphologyCells(image, radius, mask, leafSet);
+		LOG_DEBUG("Octree " << (radius < 0 ? "erosion" : "dilation") << " by " << std::abs(radius) << " in " << t.passed() << " ms");
+	}
+
+
+	template<typename T> void Octree::classifyMorphology(TypedImage<T>* image, int radius) {
+		OctreeMemoryManager::Use use(this);
+		std::vector<char> leafSet;
+		morphologyCells(image, radius, 0, leafSet);
+
+		// Apply as Morton intervals of single leaf cells
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		std::vector<uint64_t> codes;
+		for (int i = 0; i < (int)leafSet.size(); i++)
+			if (leafSet[i])
+				codes.push_back(mortonCode(i % nx, (i / nx) % ny, i / (nx * ny)));
+		std::sort(codes.begin(), codes.end());
+		std::vector<uint64_t> intervals;
+		for (uint64_t code : codes) {
+			if (!intervals.empty() && intervals.back() == code)
+				intervals.back() = code + 1;
+			else {
+				intervals.push_back(code);
+				intervals.push_back(code + 1);
+			}
+		}
+		importMortonIntervals(intervals);
+	}
+
+
+	template<typename T> void Octree::morphologyCells(const TypedImage<T>* image, int radius, TypedImage<unsigned char>* mask, std::vector<char>& leafSet) const {
+		int leaf = m_numLayers - 1;
+		int nx = (int)m_gridX[leaf].size();
+		int ny = (int)m_gridY[leaf].size();
+		bool dilate = radius >= 0;
+		radius = std::abs(radius);
+		std::vector<char> sides, inBand;
+		collectBandCells(radius, sides, inBand);
+
+		int width = image->width(), height = image->height();
+		unsigned char* maskPtr = mask ? mask->pointer() : 0;
+		leafSet.assign(sides.size(), 0);
+		parallelFor(0, (int)sides.size(), [&](int i) {
+			int px = i % nx, py = (i / nx) % ny, pz = i / (nx * ny);
+			int box[6] = { m_offsetX[leaf][px], m_offsetY[leaf][py], m_offsetZ[leaf][pz] };
+			box[3] = box[0] + m_gridX[leaf][px]; box[4] = box[1] + m_gridY[leaf][py]; box[5] = box[2] + m_gridZ[leaf][pz];
+			// Dilation keeps inside cells and erosion outside cells, far from the other side both keep their side
+			if (sides[i] != SIDE_MIXED && (!inBand[i] || (sides[i] == SIDE_IN) == dilate)) {
+				unsigned char value = sides[i] == SIDE_IN ? 1 : 0;
+				leafSet[i] = value;
+				if (maskPtr)
+					for (int z = box[2]; z < box[5]; z++)
+						for (int y = box[1]; y < box[4]; y++)
+							std::fill(maskPtr + box[0] + (size_t)width * (y + (size_t)height * z), maskPtr + box[3] + (size_t)width * (y + (size_t)height * z), value);
+				return;
+			}
+			int grown[6];
+			std::vector<float> toInside, toOutside;
+			boxDistances(image, m_min, m_max, box, radius + 1, grown, toInside, toOutside);
+			int sx = grown[3] - grown[0], sy = grown[4] - grown[1];
+			float radius2 = (float)radius * radius;
+			bool any = false;
+			for (int z = box[2]; z < box[5]; z++)
+				for (int y = box[1]; y < box[4]; y++)
+					for (int x = box[0]; x < box[3]; x++) {
+						size_t local = (x - grown[0]) + (size_t)sx * ((y - grown[1]) + (size_t)sy * (z - grown[2]));
+						bool set = dilate ? toInside[local] <= radius2 : toOutside[local] > radius2;
+						any |= set;
+						if (maskPtr)
+							maskPtr[x + (size_t)width * (y + (size_t)height * z)] = set ? 1 : 0;
+					}
+			leafSet[i] = any;
+		});
+	}
+
+	template void Octree::morphology<unsigned char>(TypedImage<unsigned char>*, TypedImage<unsigned char>*, int) const;
+	template void Octree::morphology<unsigned short>(TypedImage<unsigned short>*, TypedImage<unsigned char>*, int) const;
+	template void Octree::classifyMorphology<unsigned char>(TypedImage<unsigned char>*, int);
+	template void Octree::classifyMorphology<unsigned short>(TypedImage<unsigned short>*, int);
+
 }
@@ -6,22 +6,94 @@
 // MemImage describes the abstract interface.
 // TypedImage<T> inherits from MemImage and implements it for a concrete element type T.
 #include <Fusion/Base/TypedImage.h>
+#include <Fusion/Base/OctreeMemoryManager.h>
 
+#include <cstdint>
 #include <limits>
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <functional>
+#include <mutex>
 
 namespace Fusion
 {
 	/// Fast Octree space subdivision
 	class Octree {
 	public:
+		enum ElementType {
+			NODE,		///< Children with mixed conditions
+			LEAF_IN,	///< All children satisfy the condition
+			LEAF_OUT	///< All children violate the condition
+		};
+
+		/// Built-in rule of setInsideRange(), elements whose intensities intersect [min, max] are inside
+		/** An empty range with min > max, as a mapping may give, has nothing inside. */
+		struct RangePredicate {
+			int min;
+			int max;
+
+			ElementType operator()(int elementMin, int elementMax) const {
+				return ((min > max) || (min > elementMax) || (max < elementMin)) ? LEAF_OUT : NODE;
+			}
+		};
+
+		/// Computes the voxels of the block at (x, y, z) with size (sx, sy, sz) into values, x running fastest
+		typedef std::function<void(int x, int y, int z, int sx, int sy, int sz, int* values)> BlockSource;
+
+		/// Block of filtered values computed by filterBlocks()
+		struct FilteredBlock {
+			int x, y, z;				///< Voxel position of the block
+			int sx, sy, sz;				///< Size of the block
+			std::vector<float> values;	///< Filtered values, x running fastest
+		};
+
+		/// Approximate outcome of classifying against a range, see estimateRange()
+		struct RangeEstimate {
+			double voxels;			///< Estimated number of inside voxels
+			double voxelsError;		///< Standard error of the voxel estimate
+			int64_t minVoxels;		///< Guaranteed lower bound of inside voxels
+			int64_t maxVoxels;		///< Guaranteed upper bound of inside voxels
+			double cubes;			///< Estimated number of cubes enumerate() would produce
+			double cubesError;		///< Standard error of the leaf sampling only, the cube estimate is biased beyond it
+			int64_t minCubes;		///< Guaranteed lower bound of cubes
+			int64_t maxCubes;		///< Guaranteed upper bound of cubes
+		};
+
+		/// Probe shape for intersection queries, in continuous voxel coordinates where voxel x covers [x, x + 1)
+		/** The shape holds all points within radius of its core, which is a point for spheres, a segment for
+			capsules and an axis-aligned box for boxes. Touching counts as intersecting. */
+		struct ProbeShape {
+			enum Kind { SPHERE, CAPSULE, BOX };
+			Kind kind;
+			double a[3];	///< Sphere center, capsule segment start or box minimum corner
+			double b[3];	///< Capsule segment end or box maximum corner, unused for spheres
+			double radius;	///< Radius around the core, zero for a sharp box
+		};
+
+		/// Affine mapping from stored to rescaled intensities, rescaled = slope * stored + intercept
+		struct IntensityMapping {
+			double slope;		///< Factor, may be negative
+			double intercept;	///< Offset in rescaled units
+
+			/// Range [min, max] of exactly the stored values that map into [low, high], with min > max if none
+			void toStored(double low, double high, int& min, int& max) const;
+		};
+
+		/// Inside cube with the attributes of its element, see enumerateAttributes()
+		struct CubeAttributes {
+			int x, y, z;	///< Voxel position of the cube
+			int sx, sy, sz;	///< Size of the cube
+			int min, max;	///< Intensity bounds of the element
+			uint32_t id;	///< Element identifier, stable across classifications of the same build
+		};
+
 		/// Creates the Octree with the specified smallest cube size
 		Octree(int minCubeSize);
 
 		/// Creates and fills the Octree in a background thread with given image and minimum cube size
-		Octree(MemImage* image, int minCubeSize); // I would not accept raw pointers. Use shared_ptr instead in this place and other similar places.
+		/** Pass hashing here rather than calling setHashing() afterwards, which would race with the thread. */
+		Octree(MemImage* image, int minCubeSize, bool hashing = false); // I would not accept raw pointers. Use shared_ptr instead in this place and other similar places.
 
 		/// Destructor, deletes the Octree
 		~Octree();
@@ -30,29 +102,205 @@ namespace Fusion
 		/** Returns true if something has changed. */
 		bool setInsideRange(int min, int max);
 
-		/// Convenience method, set range with normalized scale (0..1)
+		/// Convenience method, set range with normalized scale (0..1), or in rescaled units if a mapping is set
 		bool setInsideRange(double min, double max);
 
+		/// Interpret the ranges of setInsideRange(double, double) in rescaled units, a slope of 0 restores the normalized scale
+		/** For example the DICOM rescale slope and intercept, so one build serves any rescale. */
+		void setIntensityMapping(double slope, double intercept) { m_mapping.slope = slope; m_mapping.intercept = intercept; }
+
+		const IntensityMapping& getIntensityMapping() const { return m_mapping; }
+
+		/// Stored range selected by setInsideRange(double, double) for the given range
+		void getStoredRange(double min, double max, int& storedMin, int& storedMax) const;
+
+		/// Classify with a custom inside rule, inlined at compile time
+		/** The predicate is called as predicate(min, max) with the intensity bounds of an element and returns
+			LEAF_IN, LEAF_OUT or NODE if undecided. Elements still undecided on the last level are inside. */
+		template<typename Predicate> void classify(const Predicate& predicate);
+
+		/// Estimate inside voxels and cubes for a range without classifying, in microseconds
+		/** Elements of a coarse layer are decided exactly where possible, the leaves of undecided ones are
+			sampled. The cube estimate only partly accounts for merging of inside leaves and tends to be high, by
+			far more than cubesError where many undecided elements merge, but stays within minCubes and maxCubes. */
+		RangeEstimate estimateRange(int min, int max, int numSamples = 256, unsigned int seed = 0) const;
+
+		/// Result of classifying against one of several ranges
+		struct RangeStatistics {
+			int cubes;		///< Number of cubes enumerate() would produce
+			int64_t voxels;	///< Number of voxels in these cubes
+		};
+
+		/// Classify against up to 64 intensity ranges in a single traversal
+		/** Ranges beyond the first 64 are ignored. The per-element classification of every range is kept
+			until the next call or a new image and can be made current with selectRange(). */
+		std::vector<RangeStatistics> classifyRanges(const std::vector<std::pair<int, int> >& ranges);
+
+		/// Make the classification of the given range from the last classifyRanges() call current
+		/** Returns true if something has changed. */
+		bool selectRange(int index);
+
 		/// Enumerate all inside cube cells with their position and size
 		const std::vector<int>& enumerate();
 
+		/// Enumerate all inside cube cells with the bounds and identifier of their element
+		/** Cubes come in the same order as from enumerate(). The identifier is the position of the element
+			counted over all layers from the root, so it only changes when the Octree is built for another size. */
+		const std::vector<CubeAttributes>& enumerateAttributes();
+
+		const std::vector<CubeAttributes>& getCubeAttributes() const { return m_cubeAttributes; }
+
+		/// Set the inside range and enumerate its cubes in a single traversal
+		/** Subtrees of a layer with enough elements are classified in parallel into their own cube buffers,
+			which are joined while the layers above are classified. Gives the same cubes in the same order as
+			setInsideRange() followed by enumerate(). */
+		const std::vector<int>& classifyAndEnumerate(int min, int max);
+
 		const std::vector<int>& getCubesInside() const { return m_cubesInside; }
 
+		/// Number of cubes the next enumerate() will produce for the current range
+		int getNumCubesInside() const { return m_counts.empty() ? 0 : m_counts[0][0].cubes; }
+
+		/// Number of voxels in cubes classified as inside for the current range
+		int64_t getNumVoxelsInside() const { return m_counts.empty() ? 0 : m_counts[0][0].voxels; }
+
+		/// Enumerate maximal inside voxel spans along x, parallel over z
+		/** Every span is stored as four ints (y, z, x0, x1) with x1 exclusive, sorted by z, y and x. */
+		const std::vector<int>& enumerateSpans();
+
+		const std::vector<int>& getSpansInside() const { return m_spansInside; }
+
+		/// Export the inside region as sorted, disjoint Morton code intervals of leaf cells
+		/** Every interval is stored as two codes (begin, end) with end exclusive. */
+		std::vector<uint64_t> exportMortonIntervals() const;
+
+		/// Re-apply an inside region exported by exportMortonIntervals() to an Octree of the same geometry
+		void importMortonIntervals(const std::vector<uint64_t>& intervals);
+
 		/// Fast template method to (re-)fill Octree from image data
 		template<typename T> void fill(TypedImage<T>* image);
 
 		/// Fill Octree from image data
 		void setImage(MemImage* image);
 
+		/// Fill Octree from a binary mask using bit-parallel row operations, non-zero voxels count as set
+		/** Elements get bounds 0 or 1, so setInsideRange(1, 1) selects cells with any voxel set, while
+			classify() with a predicate requiring min == 1 selects cells with all voxels set. */
+		void setMask(TypedImage<unsigned char>* mask);
+
+		/// Fill Octree from precomputed min/max of a regular brick grid, without reading any voxels
+		/** bricks holds a (min, max) pair for every brick of size brickSize, x running fastest. Bricks aligned
+			with the leaf cells give exact bounds, otherwise every leaf takes the bounds of all overlapping bricks.
+			Nothing is filled if brickSize is not positive or bricks does not match the brick grid. */
+		void setBricks(int width, int height, int slices, int typeSize, int brickSize, const std::vector<int>& bricks);
+
+		/// Fill Octree from computed voxel data that is never materialized as an image
+		/** The source is called once per leaf cell, in parallel, and must be thread-safe. The scale converts
+			normalized ranges into source values, as for setInsideRange(double, double). */
+		void setSource(int width, int height, int slices, const BlockSource& source, double scale = 1.0);
+
+		/// Keep a hash of the voxels of every leaf cell when filling from an image, required for refresh()
+		/** Takes effect on the next fill, so call it before setImage(). */
+		void setHashing(bool enable) { m_hashing = enable; }
+
+		/// Rehash the image in parallel and update only the changed leaf cells and their ancestors
+		/** The current range and the ranges of classifyRanges() are re-applied if anything changed.
+			Returns the number of changed leaf cells. */
+		int refresh();
+
+		/// Boxes covering all leaf cells that differ from another Octree of the same geometry
+		/** Subtrees with equal bounds and hashes are skipped, so both Octrees should be built with hashing,
+			otherwise only changed bounds are detected. Boxes use the same six ints as enumerate(). */
+		std::vector<int> diff(const Octree& other) const;
+
+		/// Boxes covering all leaf cells where an image of the same geometry differs from the hashed image
+		std::vector<int> diff(MemImage* image) const;
+
+		/// Tells if any inside cube intersects the voxel box [x0, x1) x [y0, y1) x [z0, z1)
+		bool intersectsInside(int x0, int y0, int z0, int x1, int y1, int z1) const;
+
+		/// Tells if the probe shape touches any inside cube
+		bool intersectsInside(const ProbeShape& shape) const;
+
+		/// Tells if the probe shape touches any voxel within the current range
+		/** Inside cubes are pruned by distance to the shape, only leaf cells not fully within the range test
+			their voxels. Instantiated for unsigned char and unsigned short. */
+		template<typename T> bool intersectsInside(TypedImage<T>* image, const ProbeShape& shape) const;
+
+		/// Penetration depth of the probe shape into the inside cubes, the radius minus the core distance
+		/** Negative values give the clearance. The depth is capped at the radius: once the core touches the
+			inside region the search stops, so how deep the core itself reaches is not measured. Nearest
+			elements are searched first and farther ones pruned. */
+		double getPenetration(const ProbeShape& shape) const;
+
+		/// Penetration depth of the probe shape into the voxels within the current range, capped at the radius as well
+		template<typename T> double getPenetration(TypedImage<T>* image, const ProbeShape& shape) const;
+
+		/// Resample the image onto a new grid, skipping output blocks that only see outside source cells
+		/** The row-major 3x4 transform maps output voxel coordinates to source voxel coordinates. Output blocks
+			whose source footprint contains no inside cube are filled with outsideValue, all others are
+			interpolated trilinearly, in parallel across blocks. Instantiated for unsigned char and unsigned short. */
+		template<typename T> void resample(TypedImage<T>* source, TypedImage<T>* output, const double transform[12], T outsideValue, int blockSize = 8) const;
+
+		/// Draw sample positions from the voxels of all inside cubes, as (x, y, z) triples in memory order
+		/** Every inside voxel is equally likely, so cells are weighted by their voxel count. Stratified sampling
+			places exactly one sample in each of numSamples equal shares of the inside voxels. */
+		std::vector<int> samplePositions(int numSamples, bool stratified, unsigned int seed = 0) const;
+
+		/// Convolve the image with a separable kernel only near inside cubes, into a dense output
+		/** The odd-sized kernels are applied along x, y and z with clamped borders, e.g. a derivative along one
+			axis and smoothing along the others for a gradient component. Only output blocks within apron voxels
+			of an inside cube are computed, in parallel, all other output voxels are left untouched.
+			Instantiated for unsigned char and unsigned short. */
+		template<typename T> void filter(TypedImage<T>* source, TypedImage<float>* output, const std::vector<float>& kernelX,
+			const std::vector<float>& kernelY, const std::vector<float>& kernelZ, int apron, int blockSize = 16) const;
+
+		/// Convolve the image with a separable kernel only near inside cubes, into a list of blocks
+		template<typename T> std::vector<FilteredBlock> filterBlocks(TypedImage<T>* source, const std::vector<float>& kernelX,
+			const std::vector<float>& kernelY, const std::vector<float>& kernelZ, int apron, int blockSize = 16) const;
+
+		/// Estimate the surface area of all voxels with value >= threshold by counting boundary voxel faces
+		/** Only leaf cells straddling the threshold are scanned completely, cells entirely above it only along
+			faces not shared with another such cell, and cells below it not at all. The spacing gives the
+			voxel size per axis. Instantiated for unsigned char and unsigned short. */
+		template<typename T> double surfaceArea(TypedImage<T>* image, int threshold, double spacingX = 1.0, double spacingY = 1.0, double spacingZ = 1.0) const;
+
+		/// Narrow band signed distance to the boundary of the voxels within the current range, negative inside
+		/** Every voxel gets the distance between voxel centers to the nearest voxel on the other side, less half
+			a voxel, clamped to [-band, band]. Only leaf cells within band voxels of a change of side are
+			transformed exactly, each on its box grown by the band. All other cells get the constant of their
+			side. Instantiated for unsigned char and unsigned short. */
+		template<typename T> void signedDistance(TypedImage<T>* image, TypedImage<float>* output, int band) const;
+
+		/// Dilate the voxels within the current range by a ball of the given radius, or erode them for a negative radius
+		/** Voxels of the result are written as 1 into the mask, all others as 0. Leaf cells farther than the radius
+			from a change of side keep their side, only the others are transformed exactly. Voxels beyond the
+			image are ignored. Instantiated for unsigned char and unsigned short. */
+		template<typename T> void morphology(TypedImage<T>* image, TypedImage<unsigned char>* mask, int radius) const;
+
+		/// Classify as the leaf cells holding voxels of the dilated or eroded region, see morphology()
+		/** enumerate() then gives its cubes. The classification no longer corresponds to a range, so the range
+			has to be set again before the next morphology. */
+		template<typename T> void classifyMorphology(TypedImage<T>* image, int radius);
+
+		/// Tight bounding box of all inside cubes as x0, y0, z0, x1, y1, z1 with exclusive ends
+		/** Each extreme is found by a descent ordered along its axis, pruning elements that cannot improve it.
+			Returns false if nothing is inside. */
+		bool getInsideBounds(int box[6]) const;
+
+		/// Bounding box of all voxels within the current range, refined from the cubes at boundary leaves
+		/** Instantiated for unsigned char and unsigned short. */
+		template<typename T> bool getInsideBounds(TypedImage<T>* image, int box[6]) const;
+
 		/// Tells if the Octree is computed and ready to use
 		bool isUsable() const { return m_usable; }
 
+		/// Memory used by the element layers and their per-element data in bytes
+		size_t getMemoryUsage() const;
+
 	protected:
-		enum ElementType {
-			NODE,		///< Children with mixed conditions
-			LEAF_IN,	///< All children satisfy the condition
-			LEAF_OUT	///< All children violate the condition
-		};
+		friend class QuantizedOctree;
+		friend class OctreeMemoryManager;
 
 		struct OctreeElement {
 			OctreeElement() :
@@ -65,14 +313,176 @@ namespace Fusion
 			ElementType type;
 		};
 
+		/// Inside statistics of an element's subtree, updated with every classification
+		struct InsideCount {
+			InsideCount() : cubes(0), voxels(0) {}
+
+			int cubes;		///< Number of LEAF_IN cubes enumerate() emits for the subtree
+			int64_t voxels;	///< Number of voxels covered by these cubes
+		};
+
+		/// Classification of an element against every range of a batch, one bit per range
+		struct RangeMask {
+			RangeMask() : in(0), node(0) {}
+
+			uint64_t in;	///< Bits of ranges for which the element is LEAF_IN
+			uint64_t node;	///< Bits of ranges for which the element is NODE
+		};
+
+		/// A subtree enumerated as one unit of parallel work, writing at a known cube offset
+		struct EnumerationTask {
+			int layer, px, py, pz;
+			int offset;
+		};
+
+		/// A subtree classified and enumerated as one unit of parallel work, see classifyAndEnumerate()
+		struct FusedTask {
+			int layer, px, py, pz;
+			std::vector<int> cubes;	///< Inside cubes of the subtree
+			int64_t voxels;			///< Number of voxels in these cubes
+		};
+
+		/// Creates the layer grids and allocates the element data for the given image size
+		void createLayers(int width, int height, int slices);
+
+		/// Forget the image, classification, batch ranges and hashes of the previous layer contents
+		void clearLayerState();
+
+		/// Create the layers for an image and fill them, the body of setImage()
+		void buildFromImage(MemImage* image);
+
+		/// Free the finest layers, keeping the classification, see OctreeMemoryManager
+		void releaseLayers();
+
+		/// Refill the released layers from the image and re-apply the kept classification and batch ranges below the kept layers
+		void restoreLayers();
+
+		/// Fill the last layer from a binary mask with any/all bits of packed 64 bit rows
+		void fillMask(TypedImage<unsigned char>* mask);
+
+		/// Fill all layers but the last one from the layer below
+		void propagateLayers();
+
+		/// Fill the bounds of an element from its children in the layer below
+		void updateFromChildren(int layer, int px, int py, int pz);
+
+		/// Fill the given leaf cells from the image again and update all their ancestors
+		void updateLeaves(const std::vector<int>& leaves);
+
+		/// Fill a single leaf cell from image data
+		template<typename T> void fillLeaf(TypedImage<T>* image, int px, int py, int pz);
+
+		/// Compute the hash of the voxels of a leaf cell in the given image
+		uint64_t hashLeaf(const MemImage* image, int px, int py, int pz) const;
+
+		/// Compute the hash of an element from the hashes of its children
+		void updateHashFromChildren(int layer, int px, int py, int pz);
+
+		/// Compute the hashes of all leaf cells in parallel and of all layers above
+		void computeHashes();
+
+		/// Recursively collect boxes of Octree children differing from another Octree, returns true if all differ
+		bool diffChildren(const Octree& other, int layer, int px, int py, int pz, std::vector<int>& boxes) const;
+
+		/// Recursively collect boxes of Octree children containing changed leaf cells, returns true if all changed
+		bool changedChildren(const std::vector<char>& changed, int layer, int px, int py, int pz, std::vector<int>& boxes) const;
+
+		/// Recursively tell if any inside Octree child intersects the voxel box
+		bool intersectsChildren(int layer, int px, int py, int pz, int x0, int y0, int z0, int x1, int y1, int z1) const;
+
+		/// Recursively convert sorted ranks of inside voxels into positions, base being the rank of the first voxel
+		void sampleChildren(int layer, int px, int py, int pz, int64_t base, const std::vector<int64_t>& ranks, size_t& next, std::vector<int>& positions) const;
+
+		/// Blocks of the given size whose box, grown by apron voxels, intersects an inside cube
+		std::vector<FilteredBlock> getActiveBlocks(int apron, int blockSize) const;
+
+		/// Recursively search the extreme inside position along an axis, refined to voxels if an image is given
+		/** For the minimum, best is the smallest start found so far, for the maximum the largest exclusive end.
+			Inside is set below a LEAF_IN element, whose descendants are all inside whatever their stored type. */
+		template<typename T> void searchBounds(const TypedImage<T>* image, int axis, bool maximum, int layer, int px, int py, int pz, bool inside, int& best) const;
+
+		/// Recursively search the smallest distance from the probe core to the inside region, nearest children first
+		/** Elements at least best away are pruned, and the search stops once best is within stopDistance.
+			Inside is set below a LEAF_IN element, whose descendants are all inside whatever their stored type. */
+		template<typename T> void probeChildren(const TypedImage<T>* image, const ProbeShape& shape, int layer, int px, int py, int pz, bool inside, double stopDistance, double& best) const;
+
+		/// Append the box of an element to a list of cubes
+		void appendBox(int layer, int px, int py, int pz, std::vector<int>& boxes) const;
+
 		/// Creates element layer subdivision given the size of an individual image dimension
 		int createLayerGrid(int dim, std::vector<std::vector<int> >& grid);
 
-		/// Recursively check and update Octree children for range condition
-		ElementType checkChildren(int layer, int px, int py, int pz);
+		/// Computes the voxel start position of every cell in every layer from the layer grid
+		void createLayerOffsets(const std::vector<std::vector<int> >& grid, std::vector<std::vector<int> >& offsets);
+
+		/// Recursively check and update Octree children for the predicate
+		template<typename Predicate> ElementType checkChildren(const Predicate& predicate, int layer, int px, int py, int pz);
+
+		/// Recursively count the cubes of the coarse layer states after merging, see estimateRange()
+		/** Undecided elements count no cube, minCubes and maxCubes bound the cubes for any outcome of them. */
+		int estimateCubes(const std::vector<char>& states, int coarse, int layer, int px, int py, int pz, int64_t leaves,
+			bool& allIn, bool& mayAllIn, int64_t& minCubes, int64_t& maxCubes) const;
+
+		/// Recursively classify Octree children against the active ranges of the batch
+		RangeMask classifyRangeChildren(int layer, int px, int py, int pz, uint64_t active, std::vector<RangeStatistics>& statistics);
+
+		/// Recursively apply the batch classification of one range to Octree children
+		ElementType selectRangeChildren(int layer, int px, int py, int pz, uint64_t bit);
+
+		/// Update the inside statistics of an element from its classification and its children
+		void updateInsideCount(int layer, int px, int py, int pz);
+
+		/// Recursively set the type and statistics of all elements below an element, so no stale type remains under a leaf
+		void setChildrenType(int layer, int px, int py, int pz, ElementType type);
+
+		/// Recursively split the inside cubes into subtrees of at most grain cubes each
+		void collectEnumerationTasks(int layer, int px, int py, int pz, int grain, int& offset, std::vector<EnumerationTask>& tasks) const;
+
+		/// Recursively enumerate Octree children which are inside with their attributes, ids counted from layerIds
+		void enumerateAttributeChildren(int layer, int px, int py, int pz, const std::vector<uint32_t>& layerIds, CubeAttributes*& cubes) const;
+
+		/// Recursively collect the elements of the split layer which the predicate leaves undecided above
+		void collectFusedTasks(const RangePredicate& predicate, int layer, int px, int py, int pz, int split, std::vector<FusedTask>& tasks) const;
+
+		/// Recursively classify Octree children and append their inside cubes, replacing them when they merge
+		/** With tasks, elements of the split layer take the result of the next task instead of being visited. */
+		ElementType fuseChildren(const RangePredicate& predicate, int layer, int px, int py, int pz, std::vector<int>& cubes, int64_t& voxels,
+			std::vector<FusedTask>* tasks, int split, size_t& next);
+
+		/// Recursively enumerate Octree children which are inside, writing six ints per cube
+		int enumerateChildren(int layer, int px, int py, int pz, int*& cubes) const;
 
-		/// Recursively enumerate Octree children which are inside
-		int enumerateChildren(int layer, int px, int py, int pz);
+		/// Recursively collect inside x-intervals of the leaf row containing voxel row (vy, vz)
+		void spanChildren(int layer, int px, int py, int pz, int vy, int vz, std::vector<int>& intervals) const;
+
+		/// Side of a leaf cell relative to the current range, see collectLeafSides()
+		enum LeafSide {
+			SIDE_OUT,	///< No voxel within the range
+			SIDE_IN,	///< All voxels within the range
+			SIDE_MIXED	///< Voxels on both sides, or not known
+		};
+
+		/// Recursively store the side of every leaf cell below an element, leaf cells in memory order
+		/** Inside is set below a LEAF_IN element, whose descendants are all inside whatever their stored type. */
+		void collectLeafSides(int layer, int px, int py, int pz, bool inside, std::vector<char>& sides) const;
+
+		/// Dilate or erode per leaf cell, writing the mask if given and whether each leaf cell holds set voxels
+		template<typename T> void morphologyCells(const TypedImage<T>* image, int radius, TypedImage<unsigned char>* mask, std::vector<char>& leafSet) const;
+
+		/// Sides of all leaf cells, and which are mixed or see a cell of another side within distance between voxel centers
+		void collectBandCells(double distance, std::vector<char>& sides, std::vector<char>& inBand) const;
+
+		/// Append the Morton code intervals covered by the leaf cells of an element
+		void getMortonRanges(int layer, int px, int py, int pz, std::vector<uint64_t>& ranges) const;
+
+		/// Recursively collect Morton code intervals of Octree children which are inside
+		void mortonChildren(int layer, int px, int py, int pz, std::vector<uint64_t>& ranges) const;
+
+		/// Sorted and merged Morton intervals of the inside region, the body of exportMortonIntervals()
+		std::vector<uint64_t> collectMortonIntervals() const;
+
+		/// Recursively classify Octree children by coverage of the given Morton code intervals
+		ElementType importChildren(int layer, int px, int py, int pz, const std::vector<uint64_t>& intervals);
 
 		/// For better readability, get the split between current and next layer
 		inline void getSplit(int layer, int& sx, int& sy, int& sz) const {
@@ -86,17 +496,82 @@ namespace Fusion
 		std::vector<std::vector<int> > m_gridX;	///< Cell size in x for every layer
 		std::vector<std::vector<int> > m_gridY;	///< Cell size in y for every layer
 		std::vector<std::vector<int> > m_gridZ;	///< Cell size in z for every layer
+		std::vector<std::vector<int> > m_offsetX;	///< Cell voxel position in x for every layer
+		std::vector<std::vector<int> > m_offsetY;	///< Cell voxel position in y for every layer
+		std::vector<std::vector<int> > m_offsetZ;	///< Cell voxel position in z for every layer
 		std::vector<OctreeElement *>   m_data;	///< Cell data for every layer
+		std::vector<std::vector<InsideCount> > m_counts;	///< Inside statistics for every layer
+		std::vector<std::vector<RangeMask> > m_rangeMasks;	///< Batch classification for every layer
+		std::vector<std::pair<int, int> > m_ranges;	///< Ranges of the last batch classification
 		int m_min;								///< Desired minimum value for range testing
 		int m_max;								///< Desired maximum value for range testing
+		bool m_classified;						///< Element types hold a classification since the last fill
 		double m_scale;							///< Scale for conversion to integer intensities
+		IntensityMapping m_mapping;				///< Mapping to rescaled intensities, unused if the slope is 0
 		std::vector<int> m_cubesInside;			///< List of all cube coordinates classified as inside
+		std::vector<int> m_spansInside;			///< List of all voxel row spans classified as inside
+		std::vector<CubeAttributes> m_cubeAttributes;	///< List of all inside cubes with their attributes
 		int m_voxelsInside;						///< Number of voxels satisfying range condition
 		std::thread* m_thread; // I would make it a unique_ptr					///< Thread for background creation of octree
 		std::atomic<bool> m_abortThread;						///< Flag whether to abort the computation 
 		bool m_usable;							///< The octree is filled and ready to use if true
+		MemImage* m_image;						///< Image the octree was filled from, if any
+		std::atomic<bool> m_hashing;			///< Compute leaf hashes when filling from an image
+		std::vector<std::vector<uint64_t> > m_hashes;	///< Hash of the voxels of every cell in every layer
+		std::atomic<bool> m_released;			///< The finest layers were released to meet the memory budget
+		std::atomic<int> m_uses;				///< Number of active OctreeMemoryManager::Use guards
+		std::mutex m_restoreMutex;				///< Serializes rebuilding released layers
+		std::vector<uint64_t> m_releasedIntervals;	///< Classification kept while released, if it has no range
 	};
 
+
+	template<typename Predicate> void Octree::classify(const Predicate& predicate) {
+		OctreeMemoryManager::Use use(this);
+		// The classification no longer corresponds to any range, force the next setInsideRange to update
+		m_min = std::numeric_limits<int>::max();
+		m_max = std::numeric_limits<int>::min();
+		m_classified = true;
+		m_voxelsInside = 0;
+		checkChildren(predicate, 0, 0, 0, 0);
+	}
+
+
+	template<typename Predicate> Octree::ElementType Octree::checkChildren(const Predicate& predicate, int layer, int px, int py, int pz) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		OctreeElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		ElementType type = predicate(element.min, element.max);
+		if (type == LEAF_OUT)
+			// Current element is outside, return at any level
+			element.type = LEAF_OUT;
+		else if (type == LEAF_IN || layer == m_numLayers - 1) {
+			// Element is entirely inside or undecided on the last level
+			element.type = LEAF_IN;
+			// Update statistics
+			m_voxelsInside += m_gridX[layer][px] * m_gridY[layer][py] * m_gridZ[layer][pz];
+		}
+		else {
+			// Something else, need to check children
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			bool allIn = true, allOut = true;
+			for (int zz = 0; zz < nzz; zz++) {
+				for (int yy = 0; yy < nyy; yy++) {
+					for (int xx = 0; xx < nxx; xx++) {
+						ElementType value = checkChildren(predicate, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz);
+						if (value == LEAF_IN)		allOut = false;
+						else if (value == LEAF_OUT) allIn = false;
+						else { allIn = false; allOut = false; }
+					}
+				}
+			}
+			if (allIn)		 element.type = LEAF_IN;
+			else if (allOut) element.type = LEAF_OUT;
+			else			 element.type = NODE;
+		}
+		updateInsideCount(layer, px, py, pz);
+		return element.type;
+	}
+
 }
 
 #endif
@@ -0,0 +1,136 @@
+#include <Fusion/Base/OctreeMemoryManager.h>
+#include <Fusion/Base/Octree.h>
+#include <Fusion/Base/Log.h>
+
+
+namespace Fusion
+{
+	OctreeMemoryManager& OctreeMemoryManager::instance() {
+		static OctreeMemoryManager manager;
+		return manager;
+	}
+
+
+	OctreeMemoryManager::OctreeMemoryManager() :
+		m_budget(0),
+		m_usage(0),
+		m_numReleased(0)
+	{
+	}
+
+
+	void OctreeMemoryManager::setBudget(size_t bytes) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_budget = bytes;
+		// Footprints are not tracked without a budget, update those of unused Octrees, which now take the lock to be used
+		m_usage = 0;
+		for (auto& it : m_entries) {
+			Octree* octree = const_cast<Octree*>(it.first);
+			if (bytes > 0 && octree->m_uses == 0)
+				it.second.bytes = octree->getMemoryUsage();
+			m_usage += it.second.bytes;
+		}
+		enforceBudget();
+	}
+
+
+	size_t OctreeMemoryManager::getBudget() const {
+		return m_budget;
+	}
+
+
+	size_t OctreeMemoryManager::getUsage() const {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_usage;
+	}
+
+
+	int OctreeMemoryManager::getNumReleased() const {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_numReleased;
+	}
+
+
+	void OctreeMemoryManager::add(Octree* octree) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_recent.push_front(octree);
+		Entry entry = { 0, m_recent.begin() };
+		m_entries[octree] = entry;
+	}
+
+
+	void OctreeMemoryManager::remove(Octree* octree) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(octree);
+		if (it == m_entries.end())
+			return;
+		m_usage -= it->second.bytes;
+		m_recent.erase(it->second.position);
+		m_entries.erase(it);
+	}
+
+
+	void OctreeMemoryManager::acquire(Octree* octree) {
+		// Count the use before reading the budget, so that a budget set meanwhile sees it and leaves the Octree alone
+		octree->m_uses++;
+		if (m_budget == 0 && !octree->m_released)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_recent.splice(m_recent.begin(), m_recent, m_entries[octree].position);
+		}
+		// Used Octrees are never released, so the rebuild can run without the lock
+		if (octree->m_released) {
+			std::lock_guard<std::mutex> lock(octree->m_restoreMutex);
+			if (octree->m_released)
+				octree->restoreLayers();
+		}
+	}
+
+
+	void OctreeMemoryManager::release(Octree* octree) {
+		if (m_budget == 0) {
+			octree->m_uses--;
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (--octree->m_uses > 0)
+			return;
+		Entry& entry = m_entries[octree];
+		size_t bytes = octree->getMemoryUsage();
+		m_usage += bytes - entry.bytes;
+		entry.bytes = bytes;
+		enforceBudget();
+	}
+
+
+	void OctreeMemoryManager::enforceBudget() {
+		// Release from the least recently used end, skipping Octrees in use or without an image to rebuild from,
+		// and the most recent one, which would be restored again right away
+		for (auto it = m_recent.rbegin(); m_budget > 0 && m_usage > m_budget && it != m_recent.rend(); ++it) {
+			Octree* octree = *it;
+			Entry& entry = m_entries[octree];
+			if (octree == m_recent.front() || octree->m_uses > 0 || !octree->m_usable || !octree->m_image || octree->m_released)
+				continue;
+			octree->releaseLayers();
+			size_t bytes = octree->getMemoryUsage();
+			LOG_DEBUG("Octree memory " << m_usage << " over budget " << m_budget << ", released " << entry.bytes - bytes << " bytes");
+			m_usage -= entry.bytes - bytes;
+			entry.bytes = bytes;
+			m_numReleased++;
+		}
+	}
+
+
+	OctreeMemoryManager::Use::Use(const Octree* octree) :
+		m_octree(const_cast<Octree*>(octree))
+	{
+		OctreeMemoryManager::instance().acquire(m_octree);
+	}
+
+
+	OctreeMemoryManager::Use::~Use() {
+		OctreeMemoryManager::instance().release(m_octree);
+	}
+
+}
@@ -0,0 +1,85 @@
+#ifndef FUSION_OCTREEMEMORYMANAGER_H
+#define FUSION_OCTREEMEMORYMANAGER_H
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace Fusion
+{
+	class Octree;
+
+	/// Process-wide memory budget shared by all Octrees
+	/** Every Octree registers itself on construction. When the layers of all Octrees exceed the budget, the
+		least recently used Octrees which were filled from an image and are not in use release their two
+		finest layers, which hold nearly all the memory. The most recently used Octree is never released.
+		Their classification is kept and the released layers are refilled from the image on next use, so
+		that image has to stay alive and unchanged as long as the Octree. Without a budget, uses only count
+		an atomic per Octree and take no lock, so recency and usage are tracked while a budget is set. */
+	class OctreeMemoryManager {
+	public:
+		/// The manager of all Octrees in this process
+		static OctreeMemoryManager& instance();
+
+		/// Set the budget in bytes, 0 for no limit, releasing Octrees until it is met
+		void setBudget(size_t bytes);
+
+		size_t getBudget() const;
+
+		/// Bytes held by the layers of all Octrees when they were last unused, only tracked while a budget is set
+		size_t getUsage() const;
+
+		/// Number of times an Octree was released to meet the budget
+		int getNumReleased() const;
+
+		/// Marks an Octree as used for its lifetime, rebuilding it first if it was released
+		class Use {
+		public:
+			Use(const Octree* octree);
+			~Use();
+
+		private:
+			Use(const Use&);
+			Use& operator=(const Use&);
+
+			Octree* m_octree;	///< The Octree in use
+		};
+
+	protected:
+		friend class Octree;
+
+		struct Entry {
+			size_t bytes;							///< Memory of the Octree when it was last unused
+			std::list<Octree*>::iterator position;	///< Position in the recently used list
+		};
+
+		OctreeMemoryManager();
+
+		/// Register a new Octree
+		void add(Octree* octree);
+
+		/// Unregister an Octree on destruction
+		void remove(Octree* octree);
+
+		/// Mark an Octree as used and most recent, then rebuild it if released
+		void acquire(Octree* octree);
+
+		/// End a use, update the footprint and release Octrees if over budget
+		void release(Octree* octree);
+
+		/// Release least recently used Octrees but the most recent one until the budget is met, the mutex must be held
+		void enforceBudget();
+
+		mutable std::mutex m_mutex;				///< Guards all members but the budget, and the release of Octrees
+		std::atomic<size_t> m_budget;			///< Budget in bytes, 0 for no limit, changed with the mutex held
+		size_t m_usage;							///< Sum of the bytes of all entries
+		int m_numReleased;						///< Number of releases so far
+		std::list<Octree*> m_recent;			///< Registered Octrees, most recently used first
+		std::unordered_map<const Octree*, Entry> m_entries;	///< Bookkeeping of every registered Octree
+	};
+
+}
+
+#endif
@@ -0,0 +1,789 @@
+// Brute-force checks of the Octree queries against plain loops over the voxels.
+// Compile together with Octree.cpp, QuantizedOctree.cpp and OctreeMemoryManager.cpp, the program returns
+// nonzero if any check fails. The checks run in the order the features were added, except for the refresh
+// checks, which come last because they modify the test volume.
+#include <Fusion/Base/Octree.h>
+#include <Fusion/Base/FixedOctree.h>
+#include <Fusion/Base/QuantizedOctree.h>
+#include <Fusion/Base/OctreeMemoryManager.h>
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace Fusion;
+
+#define CHECK(condition) do { if (!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); numFailures++; } } while (0)
+
+namespace
+{
+	int numFailures = 0;	///< Number of failed checks so far
+
+	const int Width = 37, Height = 29, Slices = 23;	///< Odd sizes, so cells of a layer differ in size
+	const int Lows[] = { 0, 1100, 1500, 2500, 3900, 70000 };	///< Lower range bounds, from everything to nothing inside
+
+
+	/// Smooth blob of 1000 to 4000 with some noise, the test volume of all checks
+	void fillBlob(TypedImage<unsigned short>& image, unsigned int seed) {
+		srand(seed);
+		for (int z = 0; z < Slices; z++)
+			for (int y = 0; y < Height; y++)
+				for (int x = 0; x < Width; x++) {
+					double dx = x - Width / 2.0, dy = y - Height / 2.0, dz = z - Slices / 2.0;
+					double r2 = dx * dx + dy * dy + dz * dz;
+					image.pointer()[x + Width * (y + Height * z)] = (unsigned short)(1000 + 3000 * std::exp(-r2 / (Width * Width / 8.0)) + rand() % 50);
+				}
+	}
+
+
+	bool inRange(TypedImage<unsigned short>& image, int x, int y, int z, int min, int max) {
+		if (x < 0 || y < 0 || z < 0 || x >= Width || y >= Height || z >= Slices)
+			return false;
+		int value = image.pointer()[x + Width * (y + Height * z)];
+		return value >= min && value <= max;
+	}
+
+
+	/// Voxel mask of cubes, or an empty mask if any voxel is covered twice
+	std::vector<char> cubeMask(const std::vector<int>& cubes) {
+		std::vector<char> mask((size_t)Width * Height * Slices, 0);
+		for (size_t i = 0; i < cubes.size(); i += 6)
+			for (int z = cubes[i + 2]; z < cubes[i + 2] + cubes[i + 5]; z++)
+				for (int y = cubes[i + 1]; y < cubes[i + 1] + cubes[i + 4]; y++)
+					for (int x = cubes[i]; x < cubes[i] + cubes[i + 3]; x++) {
+						char& voxel = mask[x + Width * (y + Height * z)];
+						if (voxel)
+							return std::vector<char>();
+						voxel = 1;
+					}
+		return mask;
+	}
+
+
+	/// Bounding box of a voxel set as x0, y0, z0, x1, y1, z1, returns false if empty
+	template<typename Inside> bool voxelBounds(const Inside& inside, int box[6]) {
+		for (int axis = 0; axis < 3; axis++) {
+			box[axis] = INT_MAX;
+			box[axis + 3] = INT_MIN;
+		}
+		for (int z = 0; z < Slices; z++)
+			for (int y = 0; y < Height; y++)
+				for (int x = 0; x < Width; x++)
+					if (inside(x, y, z)) {
+						int v[3] = { x, y, z };
+						for (int axis = 0; axis < 3; axis++) {
+							box[axis] = std::min(box[axis], v[axis]);
+							box[axis + 3] = std::max(box[axis + 3], v[axis] + 1);
+						}
+					}
+		return box[3] > box[0];
+	}
+
+
+	/// Cubes cover every voxel in range exactly once, and their counts match
+	void checkEnumeration(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		for (int low : Lows) {
+			octree.setInsideRange(low, 60000);
+			const std::vector<int>& cubes = octree.enumerate();
+			std::vector<char> mask = cubeMask(cubes);
+			CHECK(!mask.empty());
+			CHECK((int)cubes.size() == 6 * octree.getNumCubesInside());
+			int64_t voxels = 0;
+			for (size_t i = 0; i < mask.size(); i++) {
+				voxels += mask[i];
+				if (image.pointer()[i] >= low)
+					CHECK(mask[i]);
+			}
+			CHECK(voxels == octree.getNumVoxelsInside());
+
+			// Spans are the runs of the cube mask along x
+			std::vector<int> spans;
+			for (int z = 0; z < Slices; z++)
+				for (int y = 0; y < Height; y++)
+					for (int x = 0; x < Width; x++)
+						if (mask[x + Width * (y + Height * z)] && (x == 0 || !mask[x - 1 + Width * (y + Height * z)])) {
+							int end = x;
+							while (end < Width && mask[end + Width * (y + Height * z)])
+								end++;
+							spans.insert(spans.end(), { y, z, x, end });
+						}
+			CHECK(octree.enumerateSpans() == spans);
+
+			// Morton intervals restore the same classification
+			Octree copy(2);
+			copy.setImage(&image);
+			copy.importMortonIntervals(octree.exportMortonIntervals());
+			CHECK(copy.enumerate() == cubes);
+
+			// Fused, batch and fixed geometry classification give the same cubes
+			Octree fused(2);
+			fused.setImage(&image);
+			CHECK(fused.classifyAndEnumerate(low, 60000) == cubes);
+			FixedOctree<Width, Height, Slices, 2> fixed;
+			fixed.setImage(&image);
+			fixed.setInsideRange(low, 60000);
+			CHECK(fixed.enumerate() == cubes);
+
+			// Quantized bounds are conservative
+			QuantizedOctree quantized(octree);
+			quantized.setInsideRange(low, 60000);
+			std::vector<char> quantizedMask = cubeMask(quantized.enumerate());
+			for (size_t i = 0; i < mask.size(); i++)
+				if (mask[i])
+					CHECK(quantizedMask[i]);
+		}
+
+		std::vector<std::pair<int, int> > ranges;
+		for (int low : Lows)
+			ranges.push_back(std::make_pair(low, 60000));
+		std::vector<Octree::RangeStatistics> statistics = octree.classifyRanges(ranges);
+		Octree single(2);
+		single.setImage(&image);
+		for (int i = 0; i < (int)ranges.size(); i++) {
+			single.setInsideRange(ranges[i].first, ranges[i].second);
+			CHECK(statistics[i].cubes == single.getNumCubesInside());
+			CHECK(statistics[i].voxels == single.getNumVoxelsInside());
+			octree.selectRange(i);
+			CHECK(octree.enumerate() == single.enumerate());
+		}
+
+		// A new image drops the batch ranges along with their masks
+		octree.setImage(&image);
+		octree.setInsideRange(0, 1);
+		CHECK(!octree.selectRange(0));
+		CHECK(octree.getNumCubesInside() == 0);
+
+		// Refilling a fixed geometry Octree forgets the same state
+		FixedOctree<Width, Height, Slices, 2> fixed;
+		fixed.setHashing(true);
+		fixed.setImage(&image);
+		size_t hashed = fixed.getMemoryUsage();
+		fixed.classifyRanges(ranges);
+		fixed.setHashing(false);
+		fixed.setImage(&image);
+		CHECK(fixed.getMemoryUsage() < hashed);
+		CHECK(!fixed.selectRange(0));
+		CHECK(fixed.getNumCubesInside() == 0);
+		CHECK(fixed.refresh() == 0);
+	}
+
+
+	/// Octrees filled from a binary mask match Octrees filled from the same mask as 0/1 image
+	void checkMask(TypedImage<unsigned short>& image) {
+		TypedImage<unsigned char> mask(Width, Height, Slices), binary(Width, Height, Slices);
+		for (int i = 0; i < Width * Height * Slices; i++) {
+			mask.pointer()[i] = image.pointer()[i] >= 2500 ? (unsigned char)(1 + i % 3) : 0;
+			binary.pointer()[i] = mask.pointer()[i] ? 1 : 0;
+		}
+		Octree octree(2), expected(2);
+		octree.setMask(&mask);
+		expected.setImage(&binary);
+		octree.setInsideRange(1, 1);
+		expected.setInsideRange(1, 1);
+		CHECK(octree.enumerate() == expected.enumerate());
+		auto all = [](int min, int max) { return min == 1 ? Octree::LEAF_IN : (max == 0 ? Octree::LEAF_OUT : Octree::NODE); };
+		octree.classify(all);
+		expected.classify(all);
+		CHECK(octree.getNumVoxelsInside() == expected.getNumVoxelsInside());
+		CHECK(octree.enumerate() == expected.enumerate());
+	}
+
+
+	/// Octrees filled from brick bounds are exact for single voxel bricks and conservative otherwise
+	void checkBricks(TypedImage<unsigned short>& image) {
+		Octree reference(2);
+		reference.setImage(&image);
+		reference.setInsideRange(2500, 60000);
+		for (int brickSize : { 1, 3, 4 }) {
+			int bx = (Width + brickSize - 1) / brickSize, by = (Height + brickSize - 1) / brickSize, bz = (Slices + brickSize - 1) / brickSize;
+			std::vector<int> bricks;
+			for (int z = 0; z < bz; z++)
+				for (int y = 0; y < by; y++)
+					for (int x = 0; x < bx; x++) {
+						int min = INT_MAX, max = INT_MIN;
+						for (int zz = z * brickSize; zz < std::min(Slices, (z + 1) * brickSize); zz++)
+							for (int yy = y * brickSize; yy < std::min(Height, (y + 1) * brickSize); yy++)
+								for (int xx = x * brickSize; xx < std::min(Width, (x + 1) * brickSize); xx++) {
+									min = std::min(min, (int)image.pointer()[xx + Width * (yy + Height * zz)]);
+									max = std::max(max, (int)image.pointer()[xx + Width * (yy + Height * zz)]);
+								}
+						bricks.push_back(min);
+						bricks.push_back(max);
+					}
+			Octree octree(2);
+			octree.setBricks(Width, Height, Slices, 2, brickSize, bricks);
+			CHECK(octree.isUsable());
+			octree.setInsideRange(2500, 60000);
+			if (brickSize == 1)
+				CHECK(octree.enumerate() == reference.enumerate());
+			else {
+				std::vector<char> mask = cubeMask(octree.enumerate());
+				for (size_t i = 0; i < mask.size(); i++)
+					if (image.pointer()[i] >= 2500)
+						CHECK(mask[i]);
+			}
+
+			// A brick list of the wrong size and an invalid brick size are rejected
+			bricks.pop_back();
+			octree.setBricks(Width, Height, Slices, 2, brickSize, bricks);
+			CHECK(!octree.isUsable());
+		}
+		Octree octree(2);
+		octree.setBricks(Width, Height, Slices, 2, 0, std::vector<int>());
+		CHECK(!octree.isUsable());
+	}
+
+
+	/// Octrees filled from a block source reading the image match Octrees filled from the image
+	void checkSource(TypedImage<unsigned short>& image) {
+		Octree reference(2), octree(2);
+		reference.setImage(&image);
+		octree.setSource(Width, Height, Slices, [&](int x, int y, int z, int sx, int sy, int sz, int* values) {
+			for (int zz = z; zz < z + sz; zz++)
+				for (int yy = y; yy < y + sy; yy++)
+					for (int xx = x; xx < x + sx; xx++)
+						*values++ = image.pointer()[xx + Width * (yy + Height * zz)];
+		}, 65535.0);
+		CHECK(octree.isUsable());
+		for (int low : Lows) {
+			reference.setInsideRange(low, 60000);
+			octree.setInsideRange(low, 60000);
+			CHECK(octree.enumerate() == reference.enumerate());
+		}
+	}
+
+
+	/// Diff boxes cover every changed voxel without overlap, and each of them holds a change
+	void checkDiff(TypedImage<unsigned short>& image) {
+		TypedImage<unsigned short> changed(Width, Height, Slices);
+		std::copy(image.pointer(), image.pointer() + Width * Height * Slices, changed.pointer());
+		for (int z = 5; z < 9; z++)
+			for (int y = 10; y < 12; y++)
+				for (int x = 3; x < 20; x++)
+					changed.pointer()[x + Width * (y + Height * z)] ^= 1;
+		changed.pointer()[Width * Height * Slices - 1] ^= 1;
+
+		Octree octree(2), other(2);
+		octree.setHashing(true);
+		other.setHashing(true);
+		octree.setImage(&image);
+		other.setImage(&changed);
+		CHECK(octree.diff(octree).empty());
+		CHECK(octree.diff(&image).empty());
+		for (const std::vector<int>& boxes : { octree.diff(other), octree.diff(&changed) }) {
+			std::vector<char> mask = cubeMask(boxes);
+			CHECK(!mask.empty());
+			for (size_t i = 0; i < mask.size(); i++)
+				if (image.pointer()[i] != changed.pointer()[i])
+					CHECK(mask[i]);
+			for (size_t i = 0; i < boxes.size(); i += 6) {
+				bool any = false;
+				for (int z = boxes[i + 2]; z < boxes[i + 2] + boxes[i + 5]; z++)
+					for (int y = boxes[i + 1]; y < boxes[i + 1] + boxes[i + 4]; y++)
+						for (int x = boxes[i]; x < boxes[i] + boxes[i + 3]; x++)
+							any |= image.pointer()[x + Width * (y + Height * z)] != changed.pointer()[x + Width * (y + Height * z)];
+				CHECK(any);
+			}
+		}
+	}
+
+
+	/// Resampling skips only output voxels whose interpolation sees no inside cube
+	void checkResample(TypedImage<unsigned short>& image) {
+		const double transform[12] = { 0.9, 0.1, 0.0, 1.5, -0.1, 0.9, 0.05, 2.25, 0.0, -0.05, 1.1, -1.0 };
+		const unsigned short outsideValue = 7;
+		Octree all(2), octree(2);
+		all.setImage(&image);
+		all.setInsideRange(0, 65535);
+		octree.setImage(&image);
+		TypedImage<unsigned short> expected(Width, Height, Slices), output(Width, Height, Slices);
+		all.resample(&image, &expected, transform, outsideValue, 4);
+		for (int low : { 1500, 3900, 70000 }) {
+			octree.setInsideRange(low, 60000);
+			std::vector<char> mask = cubeMask(octree.enumerate());
+			octree.resample(&image, &output, transform, outsideValue, 4);
+			for (int z = 0; z < Slices; z++)
+				for (int y = 0; y < Height; y++)
+					for (int x = 0; x < Width; x++) {
+						double sx = transform[0] * x + transform[1] * y + transform[2] * z + transform[3];
+						double sy = transform[4] * x + transform[5] * y + transform[6] * z + transform[7];
+						double sz = transform[8] * x + transform[9] * y + transform[10] * z + transform[11];
+						bool visible = false;
+						for (int zz = (int)std::floor(sz); zz <= (int)std::floor(sz) + 1; zz++)
+							for (int yy = (int)std::floor(sy); yy <= (int)std::floor(sy) + 1; yy++)
+								for (int xx = (int)std::floor(sx); xx <= (int)std::floor(sx) + 1; xx++)
+									if (xx >= 0 && yy >= 0 && zz >= 0 && xx < Width && yy < Height && zz < Slices)
+										visible |= mask[xx + Width * (yy + Height * zz)] != 0;
+						int index = x + Width * (y + Height * z);
+						if (visible)
+							CHECK(output.pointer()[index] == expected.pointer()[index]);
+						else if (low > 65535)
+							CHECK(output.pointer()[index] == outsideValue);
+						else
+							CHECK(output.pointer()[index] == expected.pointer()[index] || output.pointer()[index] == outsideValue);
+					}
+		}
+	}
+
+
+	/// Sample positions lie in inside cubes in memory order, stratified sampling of every voxel hits each once
+	void checkSamplePositions(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		for (int low : { 1500, 3900, 70000 }) {
+			octree.setInsideRange(low, 60000);
+			std::vector<char> mask = cubeMask(octree.enumerate());
+			int numVoxels = (int)octree.getNumVoxelsInside();
+			for (bool stratified : { false, true }) {
+				for (int numSamples : { 1, 100, numVoxels }) {
+					std::vector<int> positions = octree.samplePositions(numSamples, stratified, 11);
+					CHECK(positions == octree.samplePositions(numSamples, stratified, 11));
+					CHECK((int)positions.size() == (numVoxels ? 3 * numSamples : 0));
+					std::vector<int> counts(mask.size(), 0);
+					int previous = -1;
+					for (size_t i = 0; i < positions.size(); i += 3) {
+						int index = positions[i] + Width * (positions[i + 1] + Height * positions[i + 2]);
+						CHECK(index >= previous && mask[index]);
+						previous = index;
+						counts[index]++;
+					}
+					if (stratified && numSamples == numVoxels)
+						CHECK(std::count(counts.begin(), counts.end(), 1) == numVoxels);
+				}
+			}
+		}
+	}
+
+
+	/// Filtered values match a direct convolution wherever the apron reaches an inside cube
+	void checkFilter(TypedImage<unsigned short>& image) {
+		const std::vector<float> kernelX = { -0.5f, 0.0f, 0.5f }, kernelY = { 0.25f, 0.5f, 0.25f }, kernelZ = { 0.1f, 0.2f, 0.4f, 0.2f, 0.1f };
+		const int apron = 2;
+		auto clamp = [](int v, int size) { return std::min(std::max(v, 0), size - 1); };
+		std::vector<float> expected((size_t)Width * Height * Slices);
+		for (int z = 0; z < Slices; z++)
+			for (int y = 0; y < Height; y++)
+				for (int x = 0; x < Width; x++) {
+					double sum = 0;
+					for (int k = 0; k < (int)kernelZ.size(); k++)
+						for (int j = 0; j < (int)kernelY.size(); j++)
+							for (int i = 0; i < (int)kernelX.size(); i++)
+								sum += kernelX[i] * kernelY[j] * kernelZ[k] * image.pointer()[clamp(x + i - 1, Width) + Width * (clamp(y + j - 1, Height) + Height * clamp(z + k - 2, Slices))];
+					expected[x + Width * (y + Height * z)] = (float)sum;
+				}
+
+		Octree octree(2);
+		octree.setImage(&image);
+		for (int low : { 1500, 3900, 70000 }) {
+			octree.setInsideRange(low, 60000);
+			std::vector<char> mask = cubeMask(octree.enumerate());
+			TypedImage<float> output(Width, Height, Slices);
+			const float untouched = -12345.0f;
+			std::fill(output.pointer(), output.pointer() + Width * Height * Slices, untouched);
+			octree.filter(&image, &output, kernelX, kernelY, kernelZ, apron, 8);
+			for (int z = 0; z < Slices; z++)
+				for (int y = 0; y < Height; y++)
+					for (int x = 0; x < Width; x++) {
+						bool near = false;
+						for (int zz = std::max(0, z - apron); zz <= std::min(Slices - 1, z + apron); zz++)
+							for (int yy = std::max(0, y - apron); yy <= std::min(Height - 1, y + apron); yy++)
+								for (int xx = std::max(0, x - apron); xx <= std::min(Width - 1, x + apron); xx++)
+									near |= mask[xx + Width * (yy + Height * zz)] != 0;
+						int index = x + Width * (y + Height * z);
+						float value = output.pointer()[index];
+						if (near)
+							CHECK(std::fabs(value - expected[index]) < 1e-3 * (1 + std::fabs(expected[index])));
+						else
+							CHECK(value == untouched || std::fabs(value - expected[index]) < 1e-3 * (1 + std::fabs(expected[index])));
+					}
+
+			// The blocks hold the same values as the dense output
+			std::vector<Octree::FilteredBlock> blocks = octree.filterBlocks(&image, kernelX, kernelY, kernelZ, apron, 8);
+			int64_t covered = 0;
+			for (const Octree::FilteredBlock& block : blocks) {
+				CHECK((int)block.values.size() == block.sx * block.sy * block.sz);
+				for (int z = 0; z < block.sz; z++)
+					for (int y = 0; y < block.sy; y++)
+						for (int x = 0; x < block.sx; x++)
+							CHECK(block.values[x + block.sx * (y + block.sy * z)] == output.pointer()[block.x + x + Width * (block.y + y + Height * (block.z + z))]);
+				covered += (int64_t)block.sx * block.sy * block.sz;
+			}
+			CHECK(covered == Width * Height * Slices - std::count(output.pointer(), output.pointer() + Width * Height * Slices, untouched));
+		}
+	}
+
+
+	/// Surface area equals the count of weighted boundary faces
+	void checkSurfaceArea(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		for (int low : Lows) {
+			double expected = 0;
+			for (int z = 0; z < Slices; z++)
+				for (int y = 0; y < Height; y++)
+					for (int x = 0; x < Width; x++)
+						if (inRange(image, x, y, z, low, INT_MAX))
+							expected += 2.0 * (!inRange(image, x - 1, y, z, low, INT_MAX) + !inRange(image, x + 1, y, z, low, INT_MAX))
+								+ 3.0 * (!inRange(image, x, y - 1, z, low, INT_MAX) + !inRange(image, x, y + 1, z, low, INT_MAX))
+								+ 6.0 * (!inRange(image, x, y, z - 1, low, INT_MAX) + !inRange(image, x, y, z + 1, low, INT_MAX));
+			CHECK(std::fabs(octree.surfaceArea(&image, low, 3.0, 2.0, 1.0) - expected) < 1e-6);
+		}
+	}
+
+
+	/// Range estimates bound the voxels and cubes of the actual classification
+	void checkEstimate(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		std::vector<std::pair<int, int> > ranges = { std::make_pair(0, 60000), std::make_pair(1000, 1030), std::make_pair(1030, 60000),
+			std::make_pair(2000, 2100), std::make_pair(5, 3) };
+		for (int low : Lows)
+			ranges.push_back(std::make_pair(low, 60000));
+		for (const auto& range : ranges) {
+			for (int numSamples : { 0, 64, 1024 }) {
+				Octree::RangeEstimate estimate = octree.estimateRange(range.first, range.second, numSamples, 3);
+				octree.setInsideRange(range.first, range.second);
+				int64_t voxels = octree.getNumVoxelsInside();
+				int cubes = octree.getNumCubesInside();
+				CHECK(estimate.minVoxels <= voxels && voxels <= estimate.maxVoxels);
+				CHECK(estimate.minCubes <= cubes && cubes <= estimate.maxCubes);
+				CHECK(estimate.minCubes <= estimate.cubes && estimate.cubes <= estimate.maxCubes);
+				if (estimate.minVoxels == estimate.maxVoxels)
+					CHECK(estimate.minCubes == cubes && estimate.maxCubes == cubes && estimate.cubes == cubes);
+			}
+		}
+	}
+
+
+	/// Bounds of the cubes and of the voxels in range
+	void checkBounds(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		// Nothing is classified yet, so there are no cubes
+		int unclassified[6];
+		CHECK(!octree.getInsideBounds(unclassified));
+		for (int low : Lows) {
+			octree.setInsideRange(low, 60000);
+			std::vector<char> mask = cubeMask(octree.enumerate());
+			int expected[6], box[6];
+			bool any = voxelBounds([&](int x, int y, int z) { return mask[x + Width * (y + Height * z)] != 0; }, expected);
+			CHECK(octree.getInsideBounds(box) == any);
+			for (int i = 0; any && i < 6; i++)
+				CHECK(box[i] == expected[i]);
+			any = voxelBounds([&](int x, int y, int z) { return inRange(image, x, y, z, low, 60000); }, expected);
+			CHECK(octree.getInsideBounds(&image, box) == any);
+			for (int i = 0; any && i < 6; i++)
+				CHECK(box[i] == expected[i]);
+		}
+
+		// Selecting a batch range over a previous classification leaves nothing stale below inside elements
+		octree.setInsideRange(0, 40);
+		octree.classifyRanges(std::vector<std::pair<int, int> >(1, std::make_pair(0, 65535)));
+		octree.selectRange(0);
+		int box[6];
+		CHECK(octree.getInsideBounds(&image, box));
+		CHECK(box[0] == 0 && box[1] == 0 && box[2] == 0 && box[3] == Width && box[4] == Height && box[5] == Slices);
+
+		// A custom rule taking the root as inside
+		octree.setInsideRange(0, 40);
+		octree.classify([](int, int) { return Octree::LEAF_IN; });
+		CHECK(octree.getInsideBounds(box));
+		CHECK(box[0] == 0 && box[1] == 0 && box[2] == 0 && box[3] == Width && box[4] == Height && box[5] == Slices);
+	}
+
+
+	/// Distance from the box core [lo, hi] of a shape to a voxel
+	double boxDistance(const double lo[3], const double hi[3], int x, int y, int z) {
+		int v[3] = { x, y, z };
+		double sum = 0;
+		for (int i = 0; i < 3; i++) {
+			double gap = std::max(std::max(v[i] - hi[i], lo[i] - (v[i] + 1)), 0.0);
+			sum += gap * gap;
+		}
+		return std::sqrt(sum);
+	}
+
+
+	/// Distance from a sphere center, capsule segment or box to a voxel
+	double coreDistance(const Octree::ProbeShape& shape, int x, int y, int z) {
+		if (shape.kind == Octree::ProbeShape::BOX)
+			return boxDistance(shape.a, shape.b, x, y, z);
+		if (shape.kind == Octree::ProbeShape::SPHERE)
+			return boxDistance(shape.a, shape.a, x, y, z);
+		// The distance along the segment is convex, narrow it down by ternary search
+		auto at = [&](double t) {
+			double p[3];
+			for (int i = 0; i < 3; i++)
+				p[i] = shape.a[i] + t * (shape.b[i] - shape.a[i]);
+			return boxDistance(p, p, x, y, z);
+		};
+		double t0 = 0, t1 = 1;
+		for (int i = 0; i < 100; i++) {
+			double m0 = t0 + (t1 - t0) / 3, m1 = t1 - (t1 - t0) / 3;
+			if (at(m0) < at(m1))
+				t1 = m1;
+			else
+				t0 = m0;
+		}
+		return std::min(std::min(at(0), at(1)), at((t0 + t1) / 2));
+	}
+
+
+	/// Probe intersection and penetration against the nearest voxel
+	void checkProbes(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		// Nothing is classified yet, so there are no cubes to touch
+		Octree::ProbeShape probe;
+		probe.kind = Octree::ProbeShape::SPHERE;
+		probe.a[0] = Width / 2.0; probe.a[1] = Height / 2.0; probe.a[2] = Slices / 2.0;
+		probe.radius = 3;
+		CHECK(!octree.intersectsInside(probe));
+		CHECK(octree.getPenetration(probe) == -INFINITY);
+
+		srand(3);
+		for (int low : { 1500, 3900, 4100 }) {
+			octree.setInsideRange(low, 60000);
+			std::vector<char> mask = cubeMask(octree.enumerate());
+			for (int i = 0; i < 60; i++) {
+				Octree::ProbeShape shape;
+				shape.kind = i % 3 == 0 ? Octree::ProbeShape::SPHERE : (i % 3 == 1 ? Octree::ProbeShape::BOX : Octree::ProbeShape::CAPSULE);
+				for (int axis = 0; axis < 3; axis++) {
+					shape.a[axis] = rand() % 4500 / 100.0 - 5;
+					shape.b[axis] = shape.a[axis] + rand() % 500 / 100.0 - (shape.kind == Octree::ProbeShape::CAPSULE ? 2.5 : 0.0);
+				}
+				shape.radius = rand() % 900 / 100.0;
+				// The box around the core gives a lower bound of the distance, compute it exactly only where it matters
+				double coreLo[3], coreHi[3];
+				for (int axis = 0; axis < 3; axis++) {
+					coreLo[axis] = shape.kind == Octree::ProbeShape::SPHERE ? shape.a[axis] : std::min(shape.a[axis], shape.b[axis]);
+					coreHi[axis] = shape.kind == Octree::ProbeShape::SPHERE ? shape.a[axis] : std::max(shape.a[axis], shape.b[axis]);
+				}
+				double cubes = INFINITY, voxels = INFINITY;
+				for (int z = 0; z < Slices; z++)
+					for (int y = 0; y < Height; y++)
+						for (int x = 0; x < Width; x++) {
+							bool cube = mask[x + Width * (y + Height * z)] != 0, voxel = inRange(image, x, y, z, low, 60000);
+							if ((!cube && !voxel) || boxDistance(coreLo, coreHi, x, y, z) >= std::max(cube ? cubes : 0.0, voxel ? voxels : 0.0))
+								continue;
+							double distance = coreDistance(shape, x, y, z);
+							if (cube)
+								cubes = std::min(cubes, distance);
+							if (voxel)
+								voxels = std::min(voxels, distance);
+						}
+				CHECK(octree.intersectsInside(shape) == (cubes <= shape.radius));
+				CHECK(octree.intersectsInside(&image, shape) == (voxels <= shape.radius));
+				// The penetration is capped at the radius, the ternary search of capsules is slightly less precise
+				double tolerance = shape.kind == Octree::ProbeShape::CAPSULE ? 1e-7 : 1e-9;
+				CHECK(std::fabs(octree.getPenetration(shape) - (shape.radius - cubes)) < tolerance || (cubes == INFINITY && octree.getPenetration(shape) == -INFINITY));
+				CHECK(std::fabs(octree.getPenetration(&image, shape) - (shape.radius - voxels)) < tolerance || (voxels == INFINITY && octree.getPenetration(&image, shape) == -INFINITY));
+			}
+		}
+	}
+
+
+	/// Cube attributes follow enumerate() with the exact voxel bounds and ids stable across ranges
+	void checkAttributes(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		std::vector<std::pair<std::vector<int>, uint32_t> > ids;
+		for (int low : Lows) {
+			octree.setInsideRange(low, 60000);
+			std::vector<int> cubes = octree.enumerate();
+			const std::vector<Octree::CubeAttributes>& attributes = octree.enumerateAttributes();
+			CHECK(cubes.size() == 6 * attributes.size());
+			for (size_t i = 0; i < attributes.size() && 6 * i < cubes.size(); i++) {
+				const Octree::CubeAttributes& cube = attributes[i];
+				std::vector<int> box = { cube.x, cube.y, cube.z, cube.sx, cube.sy, cube.sz };
+				CHECK(std::equal(box.begin(), box.end(), cubes.begin() + 6 * i));
+				int min = INT_MAX, max = INT_MIN;
+				for (int z = cube.z; z < cube.z + cube.sz; z++)
+					for (int y = cube.y; y < cube.y + cube.sy; y++)
+						for (int x = cube.x; x < cube.x + cube.sx; x++) {
+							min = std::min(min, (int)image.pointer()[x + Width * (y + Height * z)]);
+							max = std::max(max, (int)image.pointer()[x + Width * (y + Height * z)]);
+						}
+				CHECK(cube.min == min && cube.max == max);
+				ids.push_back(std::make_pair(box, cube.id));
+			}
+		}
+		// The same element keeps its id, different elements differ
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+		std::vector<uint32_t> unique;
+		for (size_t i = 0; i < ids.size(); i++) {
+			CHECK(i == 0 || ids[i].first != ids[i - 1].first);
+			unique.push_back(ids[i].second);
+		}
+		std::sort(unique.begin(), unique.end());
+		CHECK(std::unique(unique.begin(), unique.end()) == unique.end());
+	}
+
+
+	/// Mapped ranges select exactly the stored values whose rescaled value lies in the range
+	void checkMapping(TypedImage<unsigned short>& image) {
+		srand(5);
+		for (int i = 0; i < 300; i++) {
+			Octree::IntensityMapping mapping;
+			mapping.slope = i % 3 == 0 ? -0.7 : (i % 3 == 1 ? 1.0 : 0.0012345 * (1 + i % 7));
+			mapping.intercept = rand() % 6000 - 3000;
+			double low = rand() % 6000 - 3000.5, high = low + rand() % 3000 + 0.25;
+			int min, max;
+			mapping.toStored(low, high, min, max);
+			int expectedMin = INT_MAX, expectedMax = INT_MIN;
+			for (int stored = 0; stored < 65536; stored++) {
+				double rescaled = mapping.slope * stored + mapping.intercept;
+				if (rescaled >= low && rescaled <= high) {
+					expectedMin = std::min(expectedMin, stored);
+					expectedMax = std::max(expectedMax, stored);
+				}
+			}
+			if (expectedMin > expectedMax)
+				CHECK(min > max || max < 0 || min > 65535);
+			else {
+				CHECK(std::max(min, 0) == expectedMin);
+				CHECK(std::min(max, 65535) == expectedMax);
+			}
+		}
+
+		// A range between two stored values has nothing inside
+		Octree octree(2);
+		octree.setImage(&image);
+		octree.setIntensityMapping(1.0, 0.0);
+		octree.setInsideRange(1500.2, 1500.8);
+		CHECK(octree.getNumVoxelsInside() == 0);
+		CHECK(octree.enumerate().empty());
+	}
+
+
+	/// Signed distance and morphology against searching the neighbourhood of every voxel
+	void checkDistanceAndMorphology(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setImage(&image);
+		for (int low : { 1500, 2500, 3900, 70000 }) {
+			octree.setInsideRange(low, 60000);
+			const int band = 3;
+			TypedImage<float> distance(Width, Height, Slices);
+			octree.signedDistance(&image, &distance, band);
+			for (int radius : { -2, -1, 1, 2 }) {
+				TypedImage<unsigned char> mask(Width, Height, Slices);
+				octree.morphology(&image, &mask, radius);
+				int r = std::abs(radius);
+				for (int z = 0; z < Slices; z++)
+					for (int y = 0; y < Height; y++)
+						for (int x = 0; x < Width; x++) {
+							bool any = false, all = true;
+							for (int zz = z - r; zz <= z + r; zz++)
+								for (int yy = y - r; yy <= y + r; yy++)
+									for (int xx = x - r; xx <= x + r; xx++) {
+										if ((xx - x) * (xx - x) + (yy - y) * (yy - y) + (zz - z) * (zz - z) > r * r
+											|| xx < 0 || yy < 0 || zz < 0 || xx >= Width || yy >= Height || zz >= Slices)
+											continue;
+										if (inRange(image, xx, yy, zz, low, 60000))
+											any = true;
+										else
+											all = false;
+									}
+							CHECK(mask.pointer()[x + Width * (y + Height * z)] == (radius > 0 ? any : all));
+						}
+			}
+			for (int z = 0; z < Slices; z++)
+				for (int y = 0; y < Height; y++)
+					for (int x = 0; x < Width; x++) {
+						bool inside = inRange(image, x, y, z, low, 60000);
+						float nearest = INFINITY;
+						for (int zz = std::max(0, z - band - 1); zz < std::min(Slices, z + band + 2); zz++)
+							for (int yy = std::max(0, y - band - 1); yy < std::min(Height, y + band + 2); yy++)
+								for (int xx = std::max(0, x - band - 1); xx < std::min(Width, x + band + 2); xx++)
+									if (inRange(image, xx, yy, zz, low, 60000) != inside)
+										nearest = std::min(nearest, std::sqrt((float)((xx - x) * (xx - x) + (yy - y) * (yy - y) + (zz - z) * (zz - z))));
+						float expected = std::min(nearest - 0.5f, (float)band);
+						CHECK(std::fabs(distance.pointer()[x + Width * (y + Height * z)] - (inside ? -expected : expected)) < 1e-4);
+					}
+		}
+
+		// Everything is inside after selecting a full batch range over an empty classification
+		octree.setInsideRange(0, 40);
+		octree.classifyRanges(std::vector<std::pair<int, int> >(1, std::make_pair(0, 65535)));
+		octree.selectRange(0);
+		for (int radius : { -1, 1 }) {
+			TypedImage<unsigned char> mask(Width, Height, Slices);
+			octree.morphology(&image, &mask, radius);
+			CHECK(std::count(mask.pointer(), mask.pointer() + Width * Height * Slices, 1) == Width * Height * Slices);
+		}
+		octree.classifyMorphology(&image, -1);
+		CHECK(octree.getNumVoxelsInside() == Width * Height * Slices);
+	}
+
+
+	/// Refreshed and released Octrees give the same cubes as freshly built ones
+	void checkRefreshAndRelease(TypedImage<unsigned short>& image) {
+		Octree octree(2);
+		octree.setHashing(true);
+		octree.setImage(&image);
+		CHECK(octree.refresh() == 0);
+		octree.setInsideRange(2500, 60000);
+		for (int z = 3; z < 7; z++)
+			for (int y = 2; y < 5; y++)
+				for (int x = 30; x < 35; x++)
+					image.pointer()[x + Width * (y + Height * z)] = 5000;
+		CHECK(octree.refresh() > 0);
+		Octree fresh(2);
+		fresh.setImage(&image);
+		fresh.setInsideRange(2500, 60000);
+		CHECK(octree.enumerate() == fresh.enumerate());
+
+		// Batch ranges follow the refreshed image
+		TypedImage<unsigned short> flat(Width, Height, Slices);
+		fillBlob(flat, 2);
+		Octree batch(2);
+		batch.setHashing(true);
+		batch.setImage(&flat);
+		std::vector<std::pair<int, int> > ranges = { std::make_pair(3000, 4000), std::make_pair(0, 200) };
+		batch.classifyRanges(ranges);
+		std::fill(flat.pointer(), flat.pointer() + Width * Height * Slices, (unsigned short)100);
+		CHECK(batch.refresh() > 0);
+		CHECK(batch.selectRange(0));
+		CHECK(batch.getNumCubesInside() == 0);
+		CHECK(batch.selectRange(1));
+		CHECK(batch.getNumCubesInside() == 1);
+
+		OctreeMemoryManager& manager = OctreeMemoryManager::instance();
+		int released = manager.getNumReleased();
+		manager.setBudget(octree.getMemoryUsage());
+		fresh.enumerate();
+		CHECK(manager.getNumReleased() > released);
+		CHECK(octree.enumerate() == fresh.enumerate());
+		manager.setBudget(0);
+	}
+}
+
+
+int main() {
+	TypedImage<unsigned short> image(Width, Height, Slices);
+	fillBlob(image, 1);
+	checkEnumeration(image);
+	checkMask(image);
+	checkBricks(image);
+	checkSource(image);
+	checkDiff(image);
+	checkResample(image);
+	checkSamplePositions(image);
+	checkFilter(image);
+	checkSurfaceArea(image);
+	checkEstimate(image);
+	checkBounds(image);
+	checkProbes(image);
+	checkAttributes(image);
+	checkMapping(image);
+	checkDistanceAndMorphology(image);
+	checkRefreshAndRelease(image);
+	printf("%d checks failed\n", numFailures);
+	return numFailures ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+#include <Fusion/Base/QuantizedOctree.h>
+#include <Fusion/Base/Timer.h>
+#include <Fusion/Base/Log.h>
+
+
+namespace Fusion
+{
+	QuantizedOctree::QuantizedOctree(const Octree& octree) :
+		m_numLayers(octree.m_numLayers),
+		m_gridX(octree.m_gridX),
+		m_gridY(octree.m_gridY),
+		m_gridZ(octree.m_gridZ),
+		m_offsetX(octree.m_offsetX),
+		m_offsetY(octree.m_offsetY),
+		m_offsetZ(octree.m_offsetZ),
+		m_rootMin(octree.m_data[0][0].min),
+		m_rootMax(octree.m_data[0][0].max),
+		m_min(std::numeric_limits<int>::min()),
+		m_max(std::numeric_limits<int>::max()),
+		m_scale(octree.m_scale),
+		m_mapping(octree.m_mapping),
+		m_numCubesInside(0)
+	{
+		OctreeMemoryManager::Use use(&octree);
+		Timer timer;
+		for (int layer = 0; layer < m_numLayers; layer++)
+			m_data.push_back(std::vector<QuantizedElement>(m_gridX[layer].size() * m_gridY[layer].size() * m_gridZ[layer].size()));
+		quantizeChildren(octree, 0, 0, 0, 0, m_rootMin, m_rootMax);
+		LOG_DEBUG("Octree quantized to " << getMemoryUsage() << " bytes in " << timer.passed() << " ms");
+	}
+
+
+	void QuantizedOctree::quantizeChildren(const Octree& octree, int layer, int px, int py, int pz, int parentMin, int parentMax) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		int index = px + nx * (py + ny * pz);
+		const Octree::OctreeElement& source = octree.m_data[layer][index];
+		QuantizedElement& element = m_data[layer][index];
+
+		// Round outward, relative to the decoded parent bounds which contain the exact bounds
+		int64_t range = (int64_t)parentMax - parentMin;
+		if (range == 0) {
+			element.min = 0;
+			element.max = 0;
+		}
+		else {
+			element.min = (uint8_t)(((int64_t)source.min - parentMin) * 255 / range);
+			element.max = (uint8_t)((((int64_t)source.max - parentMin) * 255 + range - 1) / range);
+		}
+		element.type = Octree::NODE;
+
+		if (layer < m_numLayers - 1) {
+			int min, max;
+			decode(element, parentMin, parentMax, min, max);
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						quantizeChildren(octree, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, min, max);
+		}
+	}
+
+
+	bool QuantizedOctree::setInsideRange(int min, int max) {
+		if ((m_min == min) && (m_max == max))
+			return false;
+		m_min = min; m_max = max;
+		m_numCubesInside = 0;
+		Timer timer;
+		Octree::RangePredicate predicate = { m_min, m_max };
+		checkChildren(predicate, 0, 0, 0, 0, m_rootMin, m_rootMax);
+		LOG_DEBUG("Octree range [" << m_min << ".." << m_max << "], " << m_numCubesInside << " cubes, " << timer.passed() << " ms");
+		return true;
+	}
+
+
+	bool QuantizedOctree::setInsideRange(double min, double max) {
+		if (m_mapping.slope == 0)
+			return setInsideRange(int(min * m_scale), int(max * m_scale));
+		int storedMin, storedMax;
+		m_mapping.toStored(min, max, storedMin, storedMax);
+		return setInsideRange(storedMin, storedMax);
+	}
+
+
+	const std::vector<int>& QuantizedOctree::enumerate() {
+		m_cubesInside.clear();
+		m_cubesInside.reserve(6 * m_numCubesInside);
+		enumerateChildren(0, 0, 0, 0);
+		LOG_DEBUG("Octree has " << m_cubesInside.size() / 6 << " cubes");
+		return m_cubesInside;
+	}
+
+
+	void QuantizedOctree::enumerateChildren(int layer, int px, int py, int pz) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		const QuantizedElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		if (element.type == Octree::LEAF_IN) {
+			// Add this cube
+			m_cubesInside.push_back(m_offsetX[layer][px]);
+			m_cubesInside.push_back(m_offsetY[layer][py]);
+			m_cubesInside.push_back(m_offsetZ[layer][pz]);
+			m_cubesInside.push_back(m_gridX[layer][px]);
+			m_cubesInside.push_back(m_gridY[layer][py]);
+			m_cubesInside.push_back(m_gridZ[layer][pz]);
+		}
+		else if (element.type == Octree::NODE) {
+			// Node, need to check children
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			for (int zz = 0; zz < nzz; zz++)
+				for (int yy = 0; yy < nyy; yy++)
+					for (int xx = 0; xx < nxx; xx++)
+						enumerateChildren(layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz);
+		}
+	}
+
+
+	size_t QuantizedOctree::getMemoryUsage() const {
+		size_t bytes = 0;
+		for (const auto& layer : m_data)
+			bytes += layer.size() * sizeof(QuantizedElement);
+		return bytes;
+	}
+
+}
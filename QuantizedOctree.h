@@ -0,0 +1,137 @@
+#ifndef FUSION_QUANTIZEDOCTREE_H
+#define FUSION_QUANTIZEDOCTREE_H
+
+#include <Fusion/Base/Octree.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace Fusion
+{
+	/// Compact copy of an Octree with 8 bit element bounds
+	/** Every element keeps its min/max quantized to 8 bits relative to the bounds of its parent, rounded
+		outward so the bounds stay conservative. Classification gives the same or slightly more inside cubes
+		than the original Octree, at a quarter of the element memory. */
+	class QuantizedOctree {
+	public:
+		/// Creates the compact copy of a filled Octree, which can be deleted afterwards
+		QuantizedOctree(const Octree& octree);
+
+		/// Set the intensity range defining 'inside' and update
+		/** Returns true if something has changed. */
+		bool setInsideRange(int min, int max);
+
+		/// Convenience method, set range with normalized scale (0..1), or in rescaled units if the Octree had a mapping
+		bool setInsideRange(double min, double max);
+
+		/// Classify with a custom inside rule, see Octree::classify()
+		template<typename Predicate> void classify(const Predicate& predicate);
+
+		/// Enumerate all inside cube cells with their position and size
+		const std::vector<int>& enumerate();
+
+		const std::vector<int>& getCubesInside() const { return m_cubesInside; }
+
+		/// Memory used by the element layers in bytes
+		size_t getMemoryUsage() const;
+
+	protected:
+		struct QuantizedElement {
+			uint8_t min;	///< Lower bound, relative to the parent bounds
+			uint8_t max;	///< Upper bound, relative to the parent bounds
+			uint8_t type;	///< Octree::ElementType of the current classification
+		};
+
+		/// Recursively quantize the bounds of an element and its children, given the decoded parent bounds
+		void quantizeChildren(const Octree& octree, int layer, int px, int py, int pz, int parentMin, int parentMax);
+
+		/// Decode the conservative bounds of an element from the decoded bounds of its parent
+		static inline void decode(const QuantizedElement& element, int parentMin, int parentMax, int& min, int& max) {
+			int64_t range = (int64_t)parentMax - parentMin;
+			min = parentMin + (int)(element.min * range / 255);
+			max = parentMin + (int)((element.max * range + 254) / 255);
+		}
+
+		/// Recursively check and update Octree children for the predicate
+		template<typename Predicate> Octree::ElementType checkChildren(const Predicate& predicate, int layer, int px, int py, int pz, int parentMin, int parentMax);
+
+		/// Recursively enumerate Octree children which are inside
+		void enumerateChildren(int layer, int px, int py, int pz);
+
+		/// For better readability, get the split between current and next layer
+		inline void getSplit(int layer, int& sx, int& sy, int& sz) const {
+			sx = (int)m_gridX[layer + 1].size() / (int)m_gridX[layer].size();
+			sy = (int)m_gridY[layer + 1].size() / (int)m_gridY[layer].size();
+			sz = (int)m_gridZ[layer + 1].size() / (int)m_gridZ[layer].size();
+		}
+
+		int m_numLayers;						///< The number of layers of the octree
+		std::vector<std::vector<int> > m_gridX;	///< Cell size in x for every layer
+		std::vector<std::vector<int> > m_gridY;	///< Cell size in y for every layer
+		std::vector<std::vector<int> > m_gridZ;	///< Cell size in z for every layer
+		std::vector<std::vector<int> > m_offsetX;	///< Cell voxel position in x for every layer
+		std::vector<std::vector<int> > m_offsetY;	///< Cell voxel position in y for every layer
+		std::vector<std::vector<int> > m_offsetZ;	///< Cell voxel position in z for every layer
+		std::vector<std::vector<QuantizedElement> > m_data;	///< Quantized cell data for every layer
+		int m_rootMin;							///< Exact minimum of the whole image
+		int m_rootMax;							///< Exact maximum of the whole image
+		int m_min;								///< Desired minimum value for range testing
+		int m_max;								///< Desired maximum value for range testing
+		double m_scale;							///< Scale for conversion to integer intensities
+		Octree::IntensityMapping m_mapping;		///< Mapping to rescaled intensities, unused if the slope is 0
+		int m_numCubesInside;					///< Number of cubes classified as inside
+		std::vector<int> m_cubesInside;			///< List of all cube coordinates classified as inside
+	};
+
+
+	template<typename Predicate> void QuantizedOctree::classify(const Predicate& predicate) {
+		// The classification no longer corresponds to any range, force the next setInsideRange to update
+		m_min = std::numeric_limits<int>::max();
+		m_max = std::numeric_limits<int>::min();
+		m_numCubesInside = 0;
+		checkChildren(predicate, 0, 0, 0, 0, m_rootMin, m_rootMax);
+	}
+
+
+	template<typename Predicate> Octree::ElementType QuantizedOctree::checkChildren(const Predicate& predicate, int layer, int px, int py, int pz, int parentMin, int parentMax) {
+		int nx = (int)m_gridX[layer].size();
+		int ny = (int)m_gridY[layer].size();
+		QuantizedElement& element = m_data[layer][px + nx * (py + ny * pz)];
+		int min, max;
+		decode(element, parentMin, parentMax, min, max);
+		Octree::ElementType type = predicate(min, max);
+		if (type == Octree::LEAF_OUT)
+			element.type = Octree::LEAF_OUT;
+		else if (type == Octree::LEAF_IN || layer == m_numLayers - 1) {
+			element.type = Octree::LEAF_IN;
+			m_numCubesInside++;
+		}
+		else {
+			// Something else, need to check children
+			int nxx, nyy, nzz; getSplit(layer, nxx, nyy, nzz);
+			bool allIn = true, allOut = true;
+			int numCubes = m_numCubesInside;
+			for (int zz = 0; zz < nzz; zz++) {
+				for (int yy = 0; yy < nyy; yy++) {
+					for (int xx = 0; xx < nxx; xx++) {
+						Octree::ElementType value = checkChildren(predicate, layer + 1, nxx * px + xx, nyy * py + yy, nzz * pz + zz, min, max);
+						if (value == Octree::LEAF_IN)		allOut = false;
+						else if (value == Octree::LEAF_OUT)	allIn = false;
+						else { allIn = false; allOut = false; }
+					}
+				}
+			}
+			if (allIn) {
+				// Children collapse into a single cube
+				element.type = Octree::LEAF_IN;
+				m_numCubesInside = numCubes + 1;
+			}
+			else if (allOut) element.type = Octree::LEAF_OUT;
+			else			 element.type = Octree::NODE;
+		}
+		return (Octree::ElementType)element.type;
+	}
+
+}
+
+#endif